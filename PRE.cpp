@@ -16,44 +16,290 @@
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/GlobalsModRef.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/Analysis/OptimizationDiagnosticInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Pass.h"
 #include "llvm/Transforms/Utils/PromoteMemToReg.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/MemorySSA.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/ScopedHashTable.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/Support/raw_ostream.h"
 #include <vector>
 #include <set>
 #include <unordered_set>
 #include <map>
+#include <memory>
 #include <algorithm>
 using namespace llvm;
 using namespace std;
 
 STATISTIC(NumInstInserted, "Number of instructions inserted for PRE via Lazy Code Motion");
 STATISTIC(NumInstReplaced, "Number of instructions replaced for PRE via Lazy Code Motion");
-
-typedef pair< pair< pair<Value*, Value*>, unsigned >, Type* > term_t;
-term_t makeTerm(Value* operand1, unsigned opcode, Value* operand2, Type* type) {
-  pair<Value*, Value*> operands(operand1, operand2);
-  pair< pair<Value*, Value*>, unsigned > real_term(operands, opcode);
-  term_t term(real_term, type);
+STATISTIC(NumFullyRedundant, "Number of fully redundant instructions removed before LCM");
+STATISTIC(NumPressureDeclined, "Number of terms declined to keep register pressure down");
+STATISTIC(NumPressureShortened, "Number of redundant occurrences kept to keep register pressure down");
+STATISTIC(NumLoadsReused, "Number of operand loads at insertion points reusing an available value");
+STATISTIC(NumInjuriesUpdated, "Number of induction updates followed by a strength reduced temporary");
+STATISTIC(NumSlotsShared, "Number of PRE temporaries that share a stack slot with another");
+STATISTIC(NumEdgesSplit, "Number of critical edges split for insertions");
+STATISTIC(NumSpeculated, "Number of loop invariant terms speculated into a preheader");
+STATISTIC(NumPlacementReused, "Number of functions whose placement was reused from an identical function");
+
+STATISTIC(NumEnginePerTerm, "Number of functions solved by the per-term engine");
+STATISTIC(NumEngineBitVector, "Number of functions solved by the bit-vector engine");
+STATISTIC(NumValuesNumbered, "Number of SSA values matched to an earlier equal value by -pre-gvn");
+STATISTIC(NumEngineMinCut, "Number of functions solved by the min-cut engine");
+STATISTIC(NumEngineSparse, "Number of functions given only the dominator prepass");
+STATISTIC(NumEngineSkip, "Number of functions skipped");
+
+enum LCMEngine {
+  AutoEngine,
+  PerTermEngine,
+  BitVectorEngine,
+  MinCutEngine,
+  SparseEngine,
+  SkipEngine
+};
+
+static cl::opt<LCMEngine> Engine("pre-engine", cl::init(AutoEngine),
+    cl::desc("Choose the LCM solver"),
+    cl::values(clEnumValN(AutoEngine, "auto",
+                          "Pick an engine per function from its size and term count"),
+               clEnumValN(PerTermEngine, "per-term",
+                          "Knoop-style analyses on instructions, one term at a time"),
+               clEnumValN(BitVectorEngine, "bitvector",
+                          "Two-analysis LCM on basic blocks, all terms at once"),
+               clEnumValN(MinCutEngine, "mincut",
+                          "Speculative placement by minimum cut over block frequencies"),
+               clEnumValN(SparseEngine, "sparse",
+                          "Only remove fully redundant terms along the dominator tree"),
+               clEnumValN(SkipEngine, "skip", "Leave functions alone")));
+
+static cl::opt<unsigned> PerTermBudget("pre-per-term-budget", cl::init(100000), cl::Hidden,
+    cl::desc("Largest instructions x terms x loop depth solved by the per-term engine"));
+
+static cl::opt<unsigned> BitVectorBudget("pre-bitvector-budget", cl::init(50000000), cl::Hidden,
+    cl::desc("Largest blocks x terms solved by the bit-vector engine"));
+
+static cl::opt<unsigned> MinCutBudget("pre-mincut-budget", cl::init(1000000), cl::Hidden,
+    cl::desc("Largest blocks x terms solved by the min-cut engine for profiled functions"));
+
+static cl::opt<bool> EnableLoopSpeculation("pre-speculate-loops", cl::init(true),
+    cl::desc("Hoist loop invariant terms that cannot trap out of loops expected to iterate"));
+
+static cl::opt<bool> EnableStrengthReduction("pre-strength-reduction", cl::init(false),
+    cl::desc("Keep products of induction variables in their temporary across the updates"));
+
+static cl::opt<bool> EnableExpressionTrees("pre-expression-trees", cl::init(true), cl::Hidden,
+    cl::desc("Match terms by the expressions their operands compute, not the instructions"));
+
+static cl::opt<unsigned> MaxExpressionSize("pre-max-expression", cl::init(16), cl::Hidden,
+    cl::desc("Largest number of terms in the expression tree of a subterm"));
+
+static cl::opt<unsigned> MaxReuseScan("pre-reuse-scan", cl::init(32), cl::Hidden,
+    cl::desc("Instructions searched back from an insertion point for an available operand load"));
+
+static cl::opt<bool> EnableValueNumbering("pre-gvn", cl::init(false),
+    cl::desc("Match SSA operands of terms by value number instead of by name"));
+
+static cl::opt<bool> SplitEdges("pre-split-critical-edges", cl::init(false),
+    cl::desc("Split critical edges so that insertions can be placed on them"));
+
+static cl::opt<bool> EnablePlacementReuse("pre-reuse-placement", cl::init(true), cl::Hidden,
+    cl::desc("Reuse the placement of a structurally identical function in the module"));
+
+static cl::opt<bool> EnablePressureLimit("pre-register-pressure", cl::init(true), cl::Hidden,
+    cl::desc("Do not extend a temporary through blocks that are out of registers"));
+
+static cl::opt<bool> EmitSSA("pre-ssa", cl::init(false),
+    cl::desc("Keep PRE temporaries in SSA registers instead of stack slots"));
+
+static cl::opt<bool> CoalesceSlots("pre-coalesce-slots", cl::init(true), cl::Hidden,
+    cl::desc("Let PRE temporaries that are never live together share a stack slot"));
+
+static cl::opt<bool> EnableDomPrepass("pre-dom-prepass", cl::init(true), cl::Hidden,
+    cl::desc("Remove fully redundant terms with a dominator tree walk before LCM"));
+
+// A term is an opcode applied to operands. `type` is the result type,
+// which for casts is the destination type, `predicate` is the predicate
+// of a comparison and `source` the source element type of a GEP. An
+// operand whose bit is set in `memory` is an alloca or global the term
+// loads from; any other operand is used as it is. A load term has the
+// pointer as its only operand and is killed by the writes that clobber
+// the location it reads. An operand may also stand for a subterm, see
+// PRE::getSubterm.
+struct term_t {
+  unsigned opcode;
+  unsigned predicate;
+  Type* type;
+  Type* source;
+  unsigned memory;
+  SmallVector<Value*, 3> operands;
+
+  bool operator<(const term_t &other) const {
+    if (opcode != other.opcode) return opcode < other.opcode;
+    if (predicate != other.predicate) return predicate < other.predicate;
+    if (type != other.type) return type < other.type;
+    if (source != other.source) return source < other.source;
+    if (memory != other.memory) return memory < other.memory;
+    return operands < other.operands;
+  }
+  bool operator==(const term_t &other) const {
+    return opcode == other.opcode && predicate == other.predicate &&
+           type == other.type && source == other.source &&
+           memory == other.memory && operands == other.operands;
+  }
+};
+
+term_t makeTerm(unsigned opcode, unsigned predicate, Type* type, Type* source,
+                unsigned memory, ArrayRef<Value*> operands) {
+  term_t term;
+  term.opcode = opcode;
+  term.predicate = predicate;
+  term.type = type;
+  term.source = source;
+  term.memory = memory;
+  term.operands.append(operands.begin(), operands.end());
   return term;
 }
 
-#define term_operand1(term) (term.first.first.first)
-#define term_operand2(term) (term.first.first.second)
-#define term_opcode(term) (term.first.second)
-#define term_type(term) (term.second)
+#define term_operand(term, i) (term.operands[i])
+#define term_num_operands(term) (term.operands.size())
+#define term_operand_in_memory(term, i) ((term.memory >> (i)) & 1)
+#define term_opcode(term) (term.opcode)
+#define term_predicate(term) (term.predicate)
+#define term_type(term) (term.type)
+#define term_source_type(term) (term.source)
+
+namespace llvm {
+  template<> struct DenseMapInfo<term_t> {
+    static term_t getEmptyKey() {
+      return makeTerm(~0U, 0, NULL, NULL, 0, None);
+    }
+    static term_t getTombstoneKey() {
+      return makeTerm(~0U - 1, 0, NULL, NULL, 0, None);
+    }
+    static unsigned getHashValue(const term_t &term) {
+      return hash_combine(term.opcode, term.predicate, term.type, term.source, term.memory,
+                          hash_combine_range(term.operands.begin(), term.operands.end()));
+    }
+    static bool isEqual(const term_t &lhs, const term_t &rhs) {
+      return lhs == rhs;
+    }
+  };
+}
+
+// Where a term is computed into its temporary (OCP) and which of its
+// occurrences read the temporary instead (RO).
+struct Placement {
+  std::set<Instruction*> OCP;
+  std::set<Instruction*> RO;
+};
+
+// Local predicates of every term in every block, indexed by term number,
+// with the first (upward exposed) and last (downward exposed) occurrence.
+struct BlockPredicates {
+  DenseMap<BasicBlock*, BitVector> ANTLOC, COMP, TRANSP;
+  std::map< std::pair<BasicBlock*, unsigned>, Instruction* > upExposed, downExposed;
+};
+
+// A store of `x + step` into the memory operand `operand` of a product.
+// It injures the product instead of killing it: the temporary stays valid
+// once step times the other factor is added to it.
+struct Injury {
+  unsigned operand;
+  ConstantInt *step;
+};
+
+// The nsw/nuw/exact/inbounds and fast-math flags every occurrence of a
+// term has, so that a computation inserted for all of them keeps exactly
+// those. The occurrences themselves are left as they are.
+struct TermFlags {
+  bool seen;
+  bool noSignedWrap, noUnsignedWrap, exact, inBounds;
+  FastMathFlags fastMath;
+  TermFlags() : seen(false), noSignedWrap(false), noUnsignedWrap(false),
+                exact(false), inBounds(false) { }
+
+  void intersect(Instruction *inst) {
+    bool first = !seen;
+    seen = true;
+    if (isa<OverflowingBinaryOperator>(inst)) {
+      noSignedWrap = (first || noSignedWrap) && inst->hasNoSignedWrap();
+      noUnsignedWrap = (first || noUnsignedWrap) && inst->hasNoUnsignedWrap();
+    }
+    if (isa<PossiblyExactOperator>(inst)) {
+      exact = (first || exact) && inst->isExact();
+    }
+    if (GetElementPtrInst *gepInst = dyn_cast<GetElementPtrInst>(inst)) {
+      inBounds = (first || inBounds) && gepInst->isInBounds();
+    }
+    if (isa<FPMathOperator>(inst)) {
+      if (first) {
+        fastMath = inst->getFastMathFlags();
+      } else {
+        fastMath &= inst->getFastMathFlags();
+      }
+    }
+  }
+
+  void apply(Instruction *inst) const {
+    if (!seen) return;
+    if (isa<OverflowingBinaryOperator>(inst)) {
+      inst->setHasNoSignedWrap(noSignedWrap);
+      inst->setHasNoUnsignedWrap(noUnsignedWrap);
+    }
+    if (isa<PossiblyExactOperator>(inst)) {
+      inst->setIsExact(exact);
+    }
+    if (GetElementPtrInst *gepInst = dyn_cast<GetElementPtrInst>(inst)) {
+      gepInst->setIsInBounds(inBounds);
+    }
+    if (isa<FPMathOperator>(inst)) {
+      inst->setFastMathFlags(fastMath);
+    }
+  }
+};
+
+// What calling a function may write, as far as its callers can see.
+// Writes to its own stack frame are left out; `unknown` is set as soon as
+// it writes memory that cannot be named by a global.
+struct ModRefSummary {
+  bool unknown;
+  SetVector<GlobalValue*> globals;
+  ModRefSummary() : unknown(true) { }
+};
 
 namespace {
   struct PRE : public FunctionPass {
     static char ID; // Pass identification
-    PRE() : FunctionPass(ID) { }
+    PRE() : FunctionPass(ID), AA(NULL) { }
 
     // Entry point for the overall pre pass
     bool runOnFunction(Function &F);
+    bool doInitialization(Module &M);
+    bool doFinalization(Module &M);
 
     // For memoization
     std::map<Instruction*, bool> mem_dsafe;
@@ -61,16 +307,30 @@ namespace {
     std::map<Instruction*, bool> mem_delay;
     std::map<Instruction*, bool> mem_latest;
     std::map<Instruction*, bool> mem_isolated;
+    std::map<std::pair<Instruction*, Value*>, bool> mem_modifies;
 
     Instruction* startNode;
     Instruction* endNode;
 
-    std::set<term_t> getTerms(Function &F);
+    bool getTerm(Instruction &inst, term_t &term);
+    void getRanks(Function &F);
+    unsigned getRank(Value* operand);
+    void getValueNumbers(Function &F);
+    Value* getLeader(Value* val);
+    std::vector<term_t> getTerms(Function &F);
     Value* getAlloca(Value* val);
+    Value* getSubterm(Instruction *inst);
+    bool getOperandSubterm(term_t term, unsigned i, term_t &subterm);
+    bool Speculatable(Instruction *occurrence);
     Instruction* getStartNode(Function &F);
     Instruction* getEndNode(Function &F);
     bool Used(Instruction &inst, term_t term);
-    bool Transp(Instruction &inst, term_t term);
+    bool Transp(Instruction &inst, term_t term, bool nested = false);
+    bool Clobbers(Instruction &inst, term_t term);
+    bool Injures(Instruction &inst, term_t term, Injury &injury);
+    bool Modifies(Instruction &inst, Value* operand);
+    bool CallMayWrite(Instruction &inst, const MemoryLocation &location);
+    const ModRefSummary &getModRefSummary(Function *callee);
     bool DSafe(Instruction &inst, term_t term);
     bool Earliest(Instruction &inst, term_t term);
     bool Delay(Instruction &inst, term_t term);
@@ -85,16 +345,115 @@ namespace {
     void getIsolateds(Function &F, term_t term);
     std::set<Instruction*> getOCP(Function &F, term_t term);
     std::set<Instruction*> getRO(Function &F, term_t term);
-    bool perform_OCP_RO_Transformation(Function &F, term_t term);
+    void getPlacement(Function &F, term_t term, Placement &placement);
+    Instruction* getEdgeInsertionPoint(BasicBlock *from, BasicBlock *to);
+    void splitCriticalEdges(Function &F, std::vector<BasicBlock*> &splitBlocks);
+    bool removeSplitBlocks(const std::vector<BasicBlock*> &splitBlocks);
+    void getBlockPredicates(Function &F, const std::vector<term_t> &terms,
+                            BlockPredicates &local);
+    void getAnticipability(Function &F, unsigned numTerms, BlockPredicates &local,
+                           DenseMap<BasicBlock*, BitVector> &ANTIN,
+                           DenseMap<BasicBlock*, BitVector> &ANTOUT);
+    void getPlacementsBitVector(Function &F, const std::vector<term_t> &terms,
+                                std::vector<Placement> &placements);
+    void getPlacementsMinCut(Function &F, const std::vector<term_t> &terms,
+                             std::vector<Placement> &placements);
+    void getAnchors(Function &F, const std::vector<term_t> &terms);
+    void getRegisterPressure(Function &F, DenseMap<BasicBlock*, unsigned> *pressure);
+    void limitRegisterPressure(Function &F, const std::vector<term_t> &terms,
+                               std::vector<Placement> &placements);
+    Value* getAvailableValue(Value *operand, Instruction *insertPt);
+    Value* materializeOperand(term_t term, unsigned i, Instruction *insertPt);
+    Value* materializeTerm(term_t term, Instruction *insertPt);
+    void getInjuries(Function &F, term_t term, const Placement &placement,
+                     std::vector< std::pair<Instruction*, Injury> > &injuries);
+    void followInjury(term_t term, const Injury &injury, AllocaInst *temporary,
+                      Instruction *insertPt);
+    bool perform_OCP_RO_Transformation(Function &F, const std::vector<term_t> &terms,
+                                       const std::vector<Placement> &placements,
+                                       std::vector<AllocaInst*> &temporaries);
+    void coalesceTemporaries(Function &F, std::vector<AllocaInst*> &temporaries);
+    bool eliminateFullyRedundant(Function &F, DominatorTree &DT);
+    LCMEngine selectEngine(Function &F, unsigned numTerms);
+    void getFingerprint(Function &F, const std::vector<term_t> &terms,
+                        std::vector<unsigned> &fingerprint,
+                        std::vector<Instruction*> &insts);
 
     // getAnalysisUsage - List passes required by this pass.  We also know it
-    // will not alter the CFG, so say so.
+    // will not alter the CFG unless critical edges are split, so say so.
+    // The dominator tree and loop info are kept up to date either way.
     virtual void getAnalysisUsage(AnalysisUsage &AU) const {
-      AU.setPreservesCFG();
+      AU.addRequired<AAResultsWrapperPass>();
+      AU.addRequired<BlockFrequencyInfoWrapperPass>();
+      AU.addRequired<BranchProbabilityInfoWrapperPass>();
+      AU.addRequired<OptimizationRemarkEmitterWrapperPass>();
+      AU.addRequired<TargetTransformInfoWrapperPass>();
+      AU.addRequired<DominatorTreeWrapperPass>();
+      AU.addRequired<LoopInfoWrapperPass>();
+      AU.addPreserved<DominatorTreeWrapperPass>();
+      AU.addPreserved<LoopInfoWrapperPass>();
+      if (!SplitEdges) {
+        AU.setPreservesCFG();
+      }
     }
 
   private:
-    // Add fields and helper functions for this pass here.
+    // Placements of one function by term number and instruction number,
+    // so they can be mapped onto a function with the same fingerprint.
+    struct CachedPlacement {
+      std::vector< std::vector<unsigned> > OCP;
+      std::vector< std::vector<unsigned> > RO;
+    };
+    std::map< std::vector<unsigned>, CachedPlacement > placementCache;
+
+    // Redundant occurrences replaced so far by perform_OCP_RO_Transformation.
+    DenseMap<Value*, Value*> replacedValues;
+
+    // Terms computed at the instruction perform_OCP_RO_Transformation is
+    // inserting before, which the terms built on them reuse.
+    DenseMap<term_t, Value*> insertedValues;
+
+    // Flags of the computations materializeTerm inserts, by term.
+    DenseMap<term_t, TermFlags> insertedFlags;
+
+    // Subterms of the current function, see getSubterm: what each
+    // instruction stands for in the terms that use it, the instruction
+    // standing for each subterm, and the subterm, its tree size and
+    // whether it reads memory by that instruction.
+    DenseMap<Instruction*, Value*> subtermOf;
+    DenseMap<term_t, Value*> subtermValues;
+    DenseMap<Value*, term_t> subterms;
+    DenseMap<Value*, unsigned> subtermSizes;
+    SmallPtrSet<Value*, 16> memorySubterms;
+
+    // Answers Modifies while placements are computed.
+    AliasAnalysis *AA;
+
+    // Answers Clobbers while placements are computed. It is built after the
+    // dominator prepass and dropped before the rewrite, so it never sees
+    // the function change.
+    std::unique_ptr<MemorySSA> MSSA;
+
+    // Position of each argument, global and instruction of the current
+    // function in program order, which orders commutative operands.
+    DenseMap<Value*, unsigned> operandRanks;
+
+    // The earlier value each SSA value of the current function is known to
+    // equal under -pre-gvn, see getValueNumbers.
+    DenseMap<Value*, Value*> leaders;
+
+    // Preheader terminators that count as an occurrence of the terms
+    // speculated there, see getAnchors.
+    DenseMap<Instruction*, std::vector<term_t> > anchors;
+
+    // Summaries of the callees of the current function.
+    std::map<Function*, ModRefSummary> summaries;
+
+    // Numbers of metadata nodes and attribute lists seen by getFingerprint
+    // in this module.
+    DenseMap<MDNode*, unsigned> metadataNumbers;
+    DenseMap<void*, unsigned> attributeNumbers;
+    DenseMap<Constant*, unsigned> constantNumbers;
   };
 }
 
@@ -112,35 +471,299 @@ FunctionPass *createPartialRedundancyEliminationPass() { return new PRE(); }
 
 
 /**
- * Get a set of all terms that are binary operations.
+ * Whether memory may change between `from` and its user `to`: unless
+ * `to` follows `from` in the same block with no write in between.
+ */
+static bool isWrittenBetween(Instruction *from, Instruction *to) {
+  if (from->getParent() != to->getParent()) {
+    return true;
+  }
+  for (Instruction *inst = from->getNextNode(); inst != to; inst = inst->getNextNode()) {
+    if (!inst || inst->mayWriteToMemory()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Build the term computed by instruction `inst`.
+ * Binary operations, comparisons, conversions, selects, vector lane
+ * operations, address computations and loads through pointer values are
+ * terms. The mask of a shuffle is an operand like any other.
+ * Return false if `inst` is not a candidate for PRE.
+ */
+bool PRE::getTerm(Instruction &inst, term_t &term) {
+  unsigned predicate = 0;
+  Type* source = NULL;
+  if (inst.getNumOperands() > 32) { // one bit per operand in term_t::memory
+    return false;
+  }
+
+  if (CmpInst *cmpInst = dyn_cast<CmpInst>(&inst)) {
+    predicate = cmpInst->getPredicate();
+  } else if (GetElementPtrInst *gepInst = dyn_cast<GetElementPtrInst>(&inst)) {
+    // the base and every index are operands, so a GEP is killed like any
+    // other term: by stores to the slots they are loaded from, or where
+    // the SSA values are defined. It reads no memory itself.
+    source = gepInst->getSourceElementType();
+  } else if (LoadInst *loadInst = dyn_cast<LoadInst>(&inst)) {
+    // a load of a stack slot is an operand of other terms. Any other
+    // simple load is recomputed with the ABI alignment of its type, so it
+    // must not promise less than that.
+    Value* pointer = loadInst->getPointerOperand();
+    const DataLayout &DL = inst.getModule()->getDataLayout();
+    if (!loadInst->isSimple() || isa<AllocaInst>(pointer) || getAlloca(pointer) != pointer ||
+        (loadInst->getAlignment() != 0 &&
+         loadInst->getAlignment() < DL.getABITypeAlignment(inst.getType()))) {
+      return false;
+    }
+  } else if (isa<CastInst>(inst)) {
+    // no-op casts cost nothing to recompute.
+    if (isa<BitCastInst>(inst) || isa<AddrSpaceCastInst>(inst)) {
+      return false;
+    }
+  } else if (!inst.isBinaryOp() && !isa<SelectInst>(inst) &&
+             !isa<ExtractElementInst>(inst) && !isa<InsertElementInst>(inst) &&
+             !isa<ShuffleVectorInst>(inst)) {
+    return false;
+  }
+
+  SmallVector<Value*, 3> operands;
+  unsigned memory = 0;
+  for (unsigned i = 0, e = inst.getNumOperands(); i != e; ++i) {
+    Value* operand = inst.getOperand(i);
+    Value* alloca = getAlloca(operand);
+    if (!alloca) {
+      return false;
+    }
+    if (alloca != operand) {
+      memory |= 1 << i;
+    } else {
+      alloca = getLeader(operand);
+      if (EnableExpressionTrees && isa<Instruction>(alloca) && !isa<LoadInst>(inst)) {
+        // a subterm that reads memory has to read it as it is at `inst`.
+        Value* subterm = getSubterm(cast<Instruction>(alloca));
+        if (subterm && (!memorySubterms.count(subterm) ||
+                        !isWrittenBetween(cast<Instruction>(alloca), &inst))) {
+          alloca = subterm;
+        }
+      }
+    }
+    operands.push_back(alloca);
+  }
+
+  // commutative operations and comparisons list their operands by rank,
+  // so `a+b` and `b+a`, or `a<b` and `b>a`, are one term.
+  if (operands.size() == 2 && (inst.isCommutative() || isa<CmpInst>(inst)) &&
+      std::make_pair(getRank(operands[1]), (memory >> 1) & 1) <
+      std::make_pair(getRank(operands[0]), memory & 1)) {
+    std::swap(operands[0], operands[1]);
+    memory = ((memory & 1) << 1) | ((memory >> 1) & 1);
+    if (CmpInst *cmpInst = dyn_cast<CmpInst>(&inst)) {
+      predicate = cmpInst->getSwappedPredicate();
+    }
+  }
+
+  term = makeTerm(inst.getOpcode(), predicate, inst.getType(), source, memory, operands);
+  return true;
+}
+
+/**
+ * Number the arguments, then the globals and instructions in the order
+ * they first appear in `F`. Pointer values would also give every operand
+ * pair an order, but not the same one from run to run.
+ */
+void PRE::getRanks(Function &F) {
+  operandRanks.clear();
+  for (Argument &arg : F.args()) {
+    operandRanks.insert(std::make_pair(&arg, operandRanks.size()));
+  }
+  for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+    Instruction *inst = &*I;
+    for (Value *operand : inst->operands()) {
+      if (isa<GlobalValue>(operand)) {
+        operandRanks.insert(std::make_pair(operand, operandRanks.size()));
+      }
+    }
+    operandRanks.insert(std::make_pair(inst, operandRanks.size()));
+  }
+}
+
+/**
+ * Get the rank of a term operand. Other constants come last, as they do
+ * in canonical LLVM IR.
+ */
+unsigned PRE::getRank(Value* operand) {
+  auto found = operandRanks.find(operand);
+  return found != operandRanks.end() ? found->second : ~0U;
+}
+
+/**
+ * Find the SSA values of `F` that provably equal an earlier value, for
+ * -pre-gvn. A term uses that leader in place of the operand, so it is
+ * killed where the leader is defined and computed from the leader, which
+ * dominates every use of the values it stands for.
+ *
+ * A select of one value twice and a PHI merging one value (or itself)
+ * are that value. PHIs of one block merging the same leaders from every
+ * predecessor are one value, and so are side-effect free computations
+ * with the same opcode, flags and operand leaders where the first one
+ * dominates the other. Blocks are numbered in reverse post order, so a
+ * value reaching a PHI over a back edge only equals itself.
+ */
+void PRE::getValueNumbers(Function &F) {
+  leaders.clear();
+  if (!EnableValueNumbering) return;
+
+  DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+  std::map< std::pair<unsigned, term_t>, std::vector<Instruction*> > expressions;
+  ReversePostOrderTraversal<Function *> RPOT(&F);
+  for (BasicBlock *bb : RPOT) {
+    for (Instruction &inst : *bb) {
+      unsigned predicate = 0;
+      Type* source = NULL;
+      SmallVector<Value*, 4> operands;
+      CallInst *callInst = dyn_cast<CallInst>(&inst);
+      if (PHINode *phi = dyn_cast<PHINode>(&inst)) {
+        Value* same = NULL;
+        bool unique = true;
+        operands.push_back(bb);
+        for (BasicBlock *pred : predecessors(bb)) {
+          Value* incoming = getLeader(phi->getIncomingValueForBlock(pred));
+          operands.push_back(incoming);
+          if (incoming == phi) continue;
+          unique = unique && (!same || same == incoming);
+          same = incoming;
+        }
+        if (same && unique && (!isa<Instruction>(same) ||
+                               DT.dominates(cast<Instruction>(same), phi))) {
+          DEBUG(dbgs() << "#value number: " << *phi << " is " << *same << "\n");
+          leaders[phi] = same;
+          NumValuesNumbered++;
+          continue;
+        }
+      } else if (inst.isBinaryOp() || isa<CastInst>(inst) || isa<CmpInst>(inst) ||
+                 isa<SelectInst>(inst) || isa<GetElementPtrInst>(inst) ||
+                 isa<ExtractElementInst>(inst) || isa<InsertElementInst>(inst) ||
+                 isa<ShuffleVectorInst>(inst) ||
+                 (callInst && callInst->doesNotAccessMemory() && !callInst->mayHaveSideEffects() &&
+                  !callInst->isConvergent() && !callInst->isInlineAsm() &&
+                  !callInst->hasOperandBundles())) {
+        for (Value *operand : inst.operands()) {
+          operands.push_back(getLeader(operand));
+        }
+        if (isa<SelectInst>(inst) && operands[1] == operands[2]) {
+          DEBUG(dbgs() << "#value number: " << inst << " is " << *operands[1] << "\n");
+          leaders[&inst] = operands[1];
+          NumValuesNumbered++;
+          continue;
+        }
+        if (CmpInst *cmpInst = dyn_cast<CmpInst>(&inst)) {
+          predicate = cmpInst->getPredicate();
+        } else if (GetElementPtrInst *gepInst = dyn_cast<GetElementPtrInst>(&inst)) {
+          source = gepInst->getSourceElementType();
+        }
+        if (operands.size() == 2 && (inst.isCommutative() || isa<CmpInst>(inst)) &&
+            getRank(operands[1]) < getRank(operands[0])) {
+          std::swap(operands[0], operands[1]);
+          if (CmpInst *cmpInst = dyn_cast<CmpInst>(&inst)) {
+            predicate = cmpInst->getSwappedPredicate();
+          }
+        }
+      } else {
+        continue;
+      }
+
+      // the flags are part of the value: `add nsw` may be poison where
+      // `add` is not.
+      std::vector<Instruction*> &equal = expressions[std::make_pair(
+          inst.getRawSubclassOptionalData(),
+          makeTerm(inst.getOpcode(), predicate, inst.getType(), source, 0, operands))];
+      // PHIs are matched within their block only.
+      Instruction *leader = NULL;
+      for (Instruction *candidate : equal) {
+        if (isa<PHINode>(inst) || DT.dominates(candidate, &inst)) {
+          leader = candidate;
+          break;
+        }
+      }
+      if (leader) {
+        DEBUG(dbgs() << "#value number: " << inst << " is " << *leader << "\n");
+        leaders[&inst] = leader;
+        NumValuesNumbered++;
+      } else {
+        equal.push_back(&inst);
+      }
+    }
+  }
+}
+
+/**
+ * Get the value `val` is known to equal, or `val` itself.
+ */
+Value* PRE::getLeader(Value* val) {
+  auto found = leaders.find(val);
+  return found != leaders.end() ? found->second : val;
+}
+
+/**
+ * What recomputing `inst` costs on the target. Arithmetic and vector lane
+ * operations are asked for their own cost, which for vectors depends on
+ * the lanes and the shuffle; anything else gets the generic user cost.
+ * Zero means the target does it for free.
+ */
+static unsigned getCost(const TargetTransformInfo &TTI, Instruction &inst) {
+  if (inst.isBinaryOp()) {
+    return TTI.getArithmeticInstrCost(inst.getOpcode(), inst.getType());
+  }
+  if (isa<ExtractElementInst>(inst) || isa<InsertElementInst>(inst)) {
+    Value *vector = inst.getOperand(0);
+    ConstantInt *index = dyn_cast<ConstantInt>(inst.getOperand(isa<ExtractElementInst>(inst) ? 1 : 2));
+    return TTI.getVectorInstrCost(inst.getOpcode(), vector->getType(),
+                                  index ? index->getZExtValue() : -1);
+  }
+  if (ShuffleVectorInst *shuffle = dyn_cast<ShuffleVectorInst>(&inst)) {
+    bool single = isa<UndefValue>(shuffle->getOperand(1));
+    return TTI.getShuffleCost(single ? TargetTransformInfo::SK_PermuteSingleSrc
+                                     : TargetTransformInfo::SK_PermuteTwoSrc,
+                              shuffle->getOperand(0)->getType());
+  }
+  return TTI.getUserCost(&inst);
+}
+
+/**
+ * Get all terms, in the order of their first occurrence in `F`.
+ *
+ * The order decides where temporaries and inserted computations end up,
+ * so it must not depend on pointer values: identical input has to give
+ * identical output. A term the target computes for free is not worth a
+ * temporary and is left out.
  */
-std::set<term_t> PRE::getTerms(Function &F) {
-  std::set<term_t> terms;
+std::vector<term_t> PRE::getTerms(Function &F) {
+  std::vector<term_t> terms;
+  std::set<term_t> seen;
+  subtermOf.clear();
+  subtermValues.clear();
+  subterms.clear();
+  subtermSizes.clear();
+  memorySubterms.clear();
+  const TargetTransformInfo &TTI = getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
 
   // http://llvm.org/docs/ProgrammersManual.html#iterating-over-the-instruction-in-a-function
   for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
     Instruction *inst = &*I;
-  //  DEBUG(dbgs() << "#inst: " << *inst << "\n");
-    if (inst->isBinaryOp()) { //
-      DEBUG(dbgs() << "#binary inst: " << *inst << "\n");
-    //  DEBUG(dbgs() << "  #operands: " << inst->getNumOperands() << "\n");
-    //  DEBUG(dbgs() << "  #operand: " << *(inst->getOperand(0)) << "\n");
-    //  DEBUG(dbgs() << "  #operand: " << *(inst->getOperand(1)) << "\n");
-    //  DEBUG(dbgs() << "  #opcode: " << *(inst->getOpcodeName()) << "\n");
-
-      // Term *term = new Term(inst->getOperand(0), inst->getOpcode(), inst->getOperand(1));
-      Value* operand1 = inst->getOperand(0);
-      Value* operand2 = inst->getOperand(1);
-      Value* alloca1 = getAlloca(operand1);
-      Value* alloca2 = getAlloca(operand2);
-      if (alloca1 && alloca2) {
-        term_t term = makeTerm(alloca1, inst->getOpcode(), alloca2, inst->getType());
-        terms.insert(term);
+    term_t term;
+    if (getTerm(*inst, term) && seen.insert(term).second) {
+      if (getCost(TTI, *inst) == 0) {
+        DEBUG(dbgs() << "#free term inst: " << *inst << "\n");
+        continue;
       }
-    } else {
+      DEBUG(dbgs() << "#term inst: " << *inst << "\n");
+      terms.push_back(term);
     }
   }
-  DEBUG(dbgs() << "#done: //Total Number of Binary Operations: " << terms.size() << "\n");
+  DEBUG(dbgs() << "#done: //Total Number of Terms: " << terms.size() << "\n");
 
   return terms;
 }
@@ -166,75 +789,347 @@ Instruction* PRE::getEndNode(Function &F) {
 
 /**
  * Validate an operand.
+ * A simple load of an alloca or global stands for the memory it reads and
+ * is killed by stores to it; it is loaded again where the term is inserted,
+ * so a volatile or atomic load is not. Any other value is taken as an SSA
+ * value, which is killed only where it is defined, so promoted IR has
+ * terms as well.
  * If the operand is invalid, return NULL.
  */
 Value* PRE::getAlloca(Value* val) {
   LoadInst* loadInst = dyn_cast<LoadInst>(val);
 
-  if (loadInst) {
-    if (isa<AllocaInst>(loadInst->getOperand(0)) || isa<GlobalValue>(loadInst->getOperand(0))) {
-      return dyn_cast<Value>(loadInst->getOperand(0));
-    } else {
-      return NULL;
-    }
-  } else if (isa<Constant>(val) || isa<Argument>(val)) {
+  if (loadInst && loadInst->isSimple() &&
+      (isa<AllocaInst>(loadInst->getOperand(0)) || isa<GlobalValue>(loadInst->getOperand(0)))) {
+    return dyn_cast<Value>(loadInst->getOperand(0));
+  } else if (isa<Instruction>(val) || isa<Constant>(val) || isa<Argument>(val)) {
     return val;
   } else {
     return NULL;
   }
 }
 
+/**
+ * Get the value that stands for the expression `inst` computes in the
+ * terms that use it, or NULL if they use `inst` as a plain SSA value.
+ *
+ * An operand computed by another term is a subterm: terms are matched by
+ * the expression tree down to its leaves, so `(a+b)*c` is one term
+ * wherever `a+b` is computed. The first instruction found for a subterm
+ * stands for it. A subterm that reads memory is only taken in the block
+ * of its user with no write in between, so that it has the value the
+ * expression has at the user. A subterm is killed where any of its
+ * leaves is, and is recomputed where the term using it is inserted.
+ * Trees larger than -pre-max-expression are cut there.
+ */
+Value* PRE::getSubterm(Instruction *inst) {
+  auto found = subtermOf.find(inst);
+  if (found != subtermOf.end()) {
+    return found->second;
+  }
+  subtermOf[inst] = NULL;
+
+  // only unreachable code has cycles that do not pass a PHI.
+  DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+  Value *subterm = NULL;
+  term_t term;
+  if (DT.isReachableFromEntry(inst->getParent()) && getTerm(*inst, term)) {
+    unsigned size = 1;
+    for (unsigned i = 0, e = term_num_operands(term); i != e; ++i) {
+      size += subtermSizes.lookup(term_operand(term, i));
+    }
+    if (size <= MaxExpressionSize) {
+      subterm = subtermValues.insert(std::make_pair(term, inst)).first->second;
+      subterms[subterm] = term;
+      subtermSizes[subterm] = size;
+      bool memory = term.memory != 0 || term_opcode(term) == Instruction::Load;
+      for (unsigned i = 0, e = term_num_operands(term); i != e; ++i) {
+        memory = memory || memorySubterms.count(term_operand(term, i));
+      }
+      if (memory) {
+        memorySubterms.insert(subterm);
+      }
+    }
+  }
+  subtermOf[inst] = subterm;
+  return subterm;
+}
+
+/**
+ * Get the subterm operand `i` of `term` stands for.
+ * Return false if the operand is a leaf. The pointer of a load is always
+ * a leaf, as the load is killed where that pointer is defined.
+ */
+bool PRE::getOperandSubterm(term_t term, unsigned i, term_t &subterm) {
+  if (term_opcode(term) == Instruction::Load) {
+    return false;
+  }
+  auto found = subterms.find(term_operand(term, i));
+  if (found == subterms.end()) {
+    return false;
+  }
+  subterm = found->second;
+  return true;
+}
+
+/**
+ * Whether the term computed by `occurrence` may be computed where it
+ * would not have been: it and every subterm under it must be safe to
+ * execute speculatively, as they are all recomputed there.
+ */
+bool PRE::Speculatable(Instruction *occurrence) {
+  if (!isSafeToSpeculativelyExecute(occurrence)) {
+    return false;
+  }
+  for (Value *operand : occurrence->operands()) {
+    Instruction *operandInst = dyn_cast<Instruction>(getLeader(operand));
+    if (operandInst && subtermOf.lookup(operandInst) && !Speculatable(operandInst)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 /**
  * Check if an instruction `inst` is Used
  * based on `term`.
  */
 bool PRE::Used(Instruction &inst, term_t term) {
-  // compare two operands and opcode
-  if (inst.isBinaryOp()) {
-    Value* operand1 = getAlloca(inst.getOperand(0));
-    Value* operand2 = getAlloca(inst.getOperand(1));
-    unsigned opcode = inst.getOpcode();
-    if (operand1 == term_operand1(term) &&
-        operand2 == term_operand2(term) &&
-        opcode == term_opcode(term)) {
-      return true;
-    } else {
-      return false;
-    }
-  } else {
-    return false;
+  // compare operands, opcode, predicate and type
+  if (inst.getOpcode() != term_opcode(term)) {
+    auto anchored = anchors.find(&inst);
+    return anchored != anchors.end() &&
+           std::find(anchored->second.begin(), anchored->second.end(), term) != anchored->second.end();
   }
+  term_t used;
+  return getTerm(inst, used) && used == term;
 }
 
 /**
  * Check if an instruction `inst` is Transp
  * based on `term`.
  */
-bool PRE::Transp(Instruction &inst, term_t term) {
-  Value* operand1 = term_operand1(term);
-  Value* operand2 = term_operand2(term);
+bool PRE::Transp(Instruction &inst, term_t term, bool nested) {
+  bool writes = inst.mayWriteToMemory();
+  Injury injury;
+  // only the temporary of a top-level product follows its injuries, so
+  // an injury kills a product nested in another term.
+  bool injures = writes && !nested && Injures(inst, term, injury);
+
+  for (unsigned i = 0, e = term_num_operands(term); i != e; ++i) {
+    Value* operand = term_operand(term, i);
+
+    // a subterm is killed with its leaves.
+    term_t subterm;
+    if (getOperandSubterm(term, i, subterm)) {
+      if (!Transp(inst, subterm, true)) {
+        return false;
+      }
+      continue;
+    }
 
-  StoreInst* storeInst = dyn_cast<StoreInst>(&inst);
-  CallInst* callInst = dyn_cast<CallInst>(&inst);
-  if (storeInst) { // check if operand1 and operand2 are modified.
-    if (storeInst->getOperand(1) == operand1 ||   storeInst->getOperand(1) == operand2
-  ) {
+    // an SSA operand (or a stack slot) is killed where it is defined,
+    // PHIs included.
+    if (&inst == operand) {
       return false;
-    } else {
-      return true;
     }
-  } else if (callInst) { // if in argument list, then not transparent
-    for (auto it = callInst->arg_begin(), et = callInst->arg_end(); it != et; it++ ) {
-      Value *val = dyn_cast<Value>(it);
-      if (val->getType()->isPointerTy() && // test12.c
-          (val == operand1 || val == operand2)) {
-        return false;
-      }
+    if (!term_operand_in_memory(term, i) || !writes) continue;
+
+    // a memory operand is killed by anything that may write it, whether
+    // through the same pointer, an alias, or inside a call.
+    if (Modifies(inst, operand) && !(injures && injury.operand == i)) {
+      return false;
+    }
+  }
+
+  if (term_opcode(term) == Instruction::Load && inst.mayWriteToMemory()) {
+    return !Clobbers(inst, term);
+  }
+  return true;
+}
+
+/**
+ * Check if `inst` may write the memory operand `operand`, an alloca or
+ * global read at offset zero with the type it points to.
+ */
+bool PRE::Modifies(Instruction &inst, Value* operand) {
+  auto found = mem_modifies.find(std::make_pair(&inst, operand));
+  if (found != mem_modifies.end()) {
+    return found->second;
+  }
+  const DataLayout &DL = inst.getModule()->getDataLayout();
+  Type* type = cast<PointerType>(operand->getType())->getElementType();
+  MemoryLocation location(operand, DL.getTypeStoreSize(type));
+  bool modifies = CallMayWrite(inst, location) &&
+                  (AA->getModRefInfo(&inst, location) & MRI_Mod) != 0;
+  mem_modifies[std::make_pair(&inst, operand)] = modifies;
+  return modifies;
+}
+
+/**
+ * Check if `inst` is an induction update that only injures the product
+ * `term`: a store of `x + step` or `x - step` into its memory operand x,
+ * where x is read in the same block with no write in between. Unless the
+ * other factor is a constant, only steps of one are taken, so that the
+ * temporary is followed by an addition and not by a new product.
+ */
+bool PRE::Injures(Instruction &inst, term_t term, Injury &injury) {
+  StoreInst *storeInst = dyn_cast<StoreInst>(&inst);
+  if (!EnableStrengthReduction || term_opcode(term) != Instruction::Mul ||
+      !storeInst || !storeInst->isSimple()) {
+    return false;
+  }
+  BinaryOperator *update = dyn_cast<BinaryOperator>(storeInst->getValueOperand());
+  if (!update || (update->getOpcode() != Instruction::Add &&
+                  update->getOpcode() != Instruction::Sub)) {
+    return false;
+  }
+  LoadInst *loadInst = dyn_cast<LoadInst>(update->getOperand(0));
+  ConstantInt *step = dyn_cast<ConstantInt>(update->getOperand(1));
+  if (!loadInst && update->getOpcode() == Instruction::Add) {
+    loadInst = dyn_cast<LoadInst>(update->getOperand(1));
+    step = dyn_cast<ConstantInt>(update->getOperand(0));
+  }
+  Value *pointer = storeInst->getPointerOperand();
+  if (!loadInst || !step || !loadInst->isSimple() ||
+      loadInst->getPointerOperand() != pointer ||
+      loadInst->getParent() != storeInst->getParent()) {
+    return false;
+  }
+  for (Instruction *between = loadInst->getNextNode(); between != storeInst;
+       between = between->getNextNode()) {
+    if (!between || between->mayWriteToMemory()) {
+      return false;
+    }
+  }
+  if (update->getOpcode() == Instruction::Sub) {
+    step = cast<ConstantInt>(ConstantExpr::getNeg(step));
+  }
+
+  for (unsigned i = 0; i != 2; ++i) {
+    if (!term_operand_in_memory(term, i) || term_operand(term, i) != pointer ||
+        term_operand(term, 1 - i) == pointer) {
+      continue;
+    }
+    bool constantFactor = !term_operand_in_memory(term, 1 - i) &&
+                          isa<Constant>(term_operand(term, 1 - i));
+    if (!constantFactor && !step->isOne() && !step->isMinusOne()) {
+      return false;
     }
+    injury.operand = i;
+    injury.step = step;
     return true;
-  } else {
+  }
+  return false;
+}
+
+/**
+ * Check if `inst` may write the location loaded by the load term `term`,
+ * by asking MemorySSA for the clobber of that location at `inst`.
+ */
+bool PRE::Clobbers(Instruction &inst, term_t term) {
+  MemoryAccess *access = MSSA ? MSSA->getMemoryAccess(&inst) : NULL;
+  if (!access) {
+    return true;
+  }
+  const DataLayout &DL = inst.getModule()->getDataLayout();
+  MemoryLocation location(term_operand(term, 0), DL.getTypeStoreSize(term_type(term)));
+  return MSSA->getWalker()->getClobberingMemoryAccess(access, location) == access &&
+         CallMayWrite(inst, location);
+}
+
+/**
+ * Check if `inst`, when it is a call, may write `location`.
+ * Memory attributes of the call are trusted first; a call of a function
+ * defined in this module may write only the globals in its summary.
+ * Anything else may write anything, and is left to alias analysis.
+ */
+bool PRE::CallMayWrite(Instruction &inst, const MemoryLocation &location) {
+  CallInst *callInst = dyn_cast<CallInst>(&inst);
+  if (!callInst) {
     return true;
   }
+  // memory only the callee can reach is never an operand.
+  if (callInst->onlyReadsMemory() || callInst->onlyAccessesInaccessibleMemory()) {
+    return false;
+  }
+  Function *callee = callInst->getCalledFunction();
+  if (!callee) {
+    return true;
+  }
+  const ModRefSummary &summary = getModRefSummary(callee);
+  if (summary.unknown) {
+    return true;
+  }
+  for (GlobalValue *global : summary.globals) {
+    if (AA->alias(location, MemoryLocation(global)) != NoAlias) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Summarize what calling `callee` may write.
+ * Only functions whose definition is known to be the one that runs are
+ * summarized. A function on a call cycle is seen as unknown by the
+ * functions inside the cycle.
+ */
+const ModRefSummary &PRE::getModRefSummary(Function *callee) {
+  auto found = summaries.find(callee);
+  if (found != summaries.end()) {
+    return found->second;
+  }
+  summaries[callee]; // unknown while it is being summarized
+  if (!callee->hasExactDefinition()) {
+    return summaries[callee];
+  }
+
+  ModRefSummary summary;
+  summary.unknown = false;
+  const DataLayout &DL = callee->getParent()->getDataLayout();
+  for (inst_iterator I = inst_begin(callee), E = inst_end(callee); I != E; ++I) {
+    Instruction *inst = &*I;
+    if (!inst->mayWriteToMemory()) continue;
+
+    Value *pointer = NULL;
+    if (StoreInst *storeInst = dyn_cast<StoreInst>(inst)) {
+      pointer = storeInst->getPointerOperand();
+    } else if (MemIntrinsic *memInst = dyn_cast<MemIntrinsic>(inst)) {
+      pointer = memInst->getDest();
+    } else if (IntrinsicInst *intrinsic = dyn_cast<IntrinsicInst>(inst)) {
+      if (intrinsic->getIntrinsicID() == Intrinsic::lifetime_start ||
+          intrinsic->getIntrinsicID() == Intrinsic::lifetime_end) {
+        continue;
+      }
+    } else if (CallInst *callInst = dyn_cast<CallInst>(inst)) {
+      if (callInst->onlyReadsMemory() || callInst->onlyAccessesInaccessibleMemory()) {
+        continue;
+      }
+      if (Function *inner = callInst->getCalledFunction()) {
+        const ModRefSummary &innerSummary = getModRefSummary(inner);
+        if (!innerSummary.unknown) {
+          summary.globals.insert(innerSummary.globals.begin(), innerSummary.globals.end());
+          continue;
+        }
+      }
+    }
+
+    Value *object = pointer ? GetUnderlyingObject(pointer, DL) : NULL;
+    if (object && isa<AllocaInst>(object)) {
+      continue;
+    }
+    if (object && isa<GlobalValue>(object)) {
+      summary.globals.insert(cast<GlobalValue>(object));
+      continue;
+    }
+    summary.unknown = true;
+    break;
+  }
+
+  DEBUG(dbgs() << "#summary " << callee->getName() << ": "
+               << (summary.unknown ? "unknown" : "writes") << " " << summary.globals.size() << "\n");
+  return summaries[callee] = summary;
 }
 
 /**
@@ -249,8 +1144,9 @@ bool PRE::DSafe(Instruction &inst, term_t term) {
   } else if (Used(inst, term)) {
     dsafe = true;
   } else if (Transp(inst, term)) {
-    dsafe = true;
     std::set<Instruction*> successors = getSuccessors(&inst);
+    // every return is an exit, not only the one endNode stands for.
+    dsafe = !successors.empty();
     for (auto I = successors.begin(), E = successors.end(); I != E; ++I) {
       Instruction *m = *I;
       if (mem_dsafe.find(m) == mem_dsafe.end()) continue; // instruction not calculated yet.
@@ -591,27 +1487,16 @@ std::set<Instruction*> PRE::getRO(Function &F, term_t term) {
 }
 
 /**
- * Perform OCP-RO Transformation
+ * Solve the LCM equations for `term` and record where it has to be
+ * computed into its temporary (OCP) and which occurrences read the
+ * temporary instead (RO).
  */
-bool PRE::perform_OCP_RO_Transformation(Function &F, term_t term) {
-  bool Changed = false;
-  // Value* termVal1 = term_operand1(term);
-  // Value* termVal2 = term_operand2(term);
-  // DEBUG(dbgs() << "#perform_OCP_RO_Transformation Val1: " << *termVal1 << " Val2: " << *termVal2 << "\n");
-  startNode = getStartNode(F);
-  endNode = getEndNode(F);
- // DEBUG(dbgs() << "end node: " << *endNode << "\n");
-//  DEBUG(dbgs() << "Begin getDSafes\n");
+void PRE::getPlacement(Function &F, term_t term, Placement &placement) {
   getDSafes(F, term);
-//  DEBUG(dbgs() << "Begin getEarliests\n");
   getEarliests(F, term);
- // DEBUG(dbgs() << "Begin getDelays\n");
   getDelays(F, term);
- // DEBUG(dbgs() << "Begin getLatests\n");
   getLatests(F, term);
- // DEBUG(dbgs() << "Begin getIsolateds\n");
   getIsolateds(F, term);
-  // DEBUG(dbgs() << "Done gettings sets\n");
 
   /*
   DEBUG(dbgs() << "#Stats\n");
@@ -626,91 +1511,1863 @@ bool PRE::perform_OCP_RO_Transformation(Function &F, term_t term) {
   }
   */
 
-  std::set<Instruction*> OCP = getOCP(F, term);
-  std::set<Instruction*> RO = getRO(F, term);
+  placement.OCP = getOCP(F, term);
+  placement.RO = getRO(F, term);
 
   DEBUG(dbgs() << "#OCP\n");
-  for (auto I : OCP) {
+  for (auto I : placement.OCP) {
     DEBUG(dbgs() << *I << "\n");
   }
 
   DEBUG(dbgs() << "\n#RO\n");
-  for (auto I : RO) {
+  for (auto I : placement.RO) {
     DEBUG(dbgs() << *I << "\n");
   }
+}
 
-  // insert instruction that is both earliest and
-  // and update term to load inst
-  if (OCP.size() > 0 && RO.size() > 0) {
-    Changed = true;
-    Instruction *firstInst = &(F.front().front());
-    Value* allocaInst = dyn_cast<Value>(new AllocaInst(term_type(term), Twine(), firstInst));  // alloca inst for term.
-
-    ReversePostOrderTraversal<Function *> RPOT(&F);
-    for (ReversePostOrderTraversal<Function *>::rpo_iterator RI = RPOT.begin(),
-                                                             RE = RPOT.end();
-         RI != RE; ++RI) {
-      BasicBlock * bb = *RI;
-      for (auto it = bb->begin(), ite = bb->end(); it != ite; ++it) {
-        Instruction * inst = &*it;
-        if (OCP.find(inst) != OCP.end()) {
-          // insert instruction
-          Value* loadInst1 = term_operand1(term);
-          Value* loadInst2 = term_operand2(term);
-          // if (isa<AllocaInst>(loadInst1) || isa<GetElementPtrInst>(loadInst1)) {
-          if (loadInst1->getType()->isPointerTy()) {
-            loadInst1 = dyn_cast<Value>(new LoadInst(loadInst1, Twine(), inst));
-          }
-          // if (isa<AllocaInst>(loadInst2)  || isa<GetElementPtrInst>(loadInst2)) {
-          if (loadInst2->getType()->isPointerTy()) {
-            loadInst2 = dyn_cast<Value>(new LoadInst(loadInst2, Twine(), inst));
-          }
-          DEBUG(dbgs() << "#insert\n");
-          DEBUG(dbgs() << *loadInst1 << " " << *(loadInst1->getType()) << "\n");
-          DEBUG(dbgs() << *loadInst2 << " " << *(loadInst2->getType()) <<  "\n");
-
-          Value* binaryOperator = dyn_cast<Value>(BinaryOperator::Create((Instruction::BinaryOps)(term_opcode(term)), loadInst1, loadInst2, Twine(), inst));
-          (void)dyn_cast<Value>(new StoreInst(binaryOperator, allocaInst, inst));
-          NumInstInserted++;
-        }
-        if (RO.find(inst) != RO.end()) {
-          auto nextIt = ++it;
-          LLVMContext & C = inst->getModule()->getContext();
-          IRBuilder<> IRB(C);
-          DEBUG(dbgs() << "@@ " << *allocaInst << "\n");
-          auto loadInst = IRB.CreateLoad(allocaInst, Twine());
-          DEBUG(dbgs() << "    replace to: " << *loadInst << "\n");
-
-          ReplaceInstWithInst(inst, loadInst); // replace with load instruction.
+/**
+ * Get the instruction before which code placed on the edge `from` -> `to`
+ * has to be inserted, or NULL if the edge is critical.
+ */
+Instruction* PRE::getEdgeInsertionPoint(BasicBlock *from, BasicBlock *to) {
+  if (from->getTerminator()->getNumSuccessors() == 1) {
+    return from->getTerminator();
+  }
+  if (to->getSinglePredecessor()) {
+    return &*(to->getFirstInsertionPt());
+  }
+  return NULL;
+}
 
-          // DEBUG(dbgs() << "    done replacing" << *loadInst << "\n");
-          it = --nextIt; // restore it.
-          NumInstReplaced++;
-        }
+/**
+ * Split every critical edge of `F` that can be split, so that each edge
+ * has an insertion point. The new blocks are appended to `splitBlocks`.
+ * The dominator tree and loop info are updated, and each new block gets
+ * the frequency of its edge for the min-cut engine.
+ */
+void PRE::splitCriticalEdges(Function &F, std::vector<BasicBlock*> &splitBlocks) {
+  DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+  LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+  BlockFrequencyInfo &BFI = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+  BranchProbabilityInfo &BPI = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
+
+  std::vector< std::pair<TerminatorInst*, unsigned> > edges;
+  for (BasicBlock &bb : F) {
+    TerminatorInst *terminator = bb.getTerminator();
+    for (unsigned i = 0, e = terminator->getNumSuccessors(); i != e; ++i) {
+      if (isCriticalEdge(terminator, i)) {
+        edges.push_back(std::make_pair(terminator, i));
       }
     }
   }
 
-  DEBUG(dbgs() << "\n#Done perform_OCP_RO_Transformation\n");
-  //for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
-    //Instruction *inst = &*I;
-  //  DEBUG(dbgs() << *inst << "\n");
-  //}
-
-  return Changed;
+  for (auto &edge : edges) {
+    BasicBlock *from = edge.first->getParent();
+    BlockFrequency frequency = BFI.getBlockFreq(from) *
+                               BPI.getEdgeProbability(from, edge.second);
+    BasicBlock *split = SplitCriticalEdge(edge.first, edge.second,
+                                          CriticalEdgeSplittingOptions(&DT, &LI));
+    if (!split) continue;
+    BFI.setBlockFreq(split, frequency.getFrequency());
+    splitBlocks.push_back(split);
+    NumEdgesSplit++;
+  }
 }
 
-bool PRE::runOnFunction(Function &F) {
-
-  bool Changed = false;
-
-  DEBUG(dbgs() << "#### PRE ####\n");
+/**
+ * Remove the blocks of splitCriticalEdges that received no insertion,
+ * joining their edge again. Return whether any of them is kept.
+ */
+bool PRE::removeSplitBlocks(const std::vector<BasicBlock*> &splitBlocks) {
+  DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+  LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+
+  bool kept = false;
+  for (BasicBlock *split : splitBlocks) {
+    if (split->size() != 1) {
+      kept = true;
+      continue;
+    }
+    BasicBlock *from = split->getSinglePredecessor();
+    BasicBlock *to = split->getSingleSuccessor();
+    from->getTerminator()->replaceUsesOfWith(split, to);
+    for (auto it = to->begin(); PHINode *phi = dyn_cast<PHINode>(&*it); ++it) {
+      phi->setIncomingBlock(phi->getBasicBlockIndex(split), from);
+    }
+    if (DT.getNode(to)->getIDom()->getBlock() == split) {
+      DT.changeImmediateDominator(to, from);
+    }
+    DT.eraseNode(split);
+    LI.removeBlock(split);
+    split->eraseFromParent();
+  }
+  return kept;
+}
+
+/**
+ * Calculate the local predicates of every term in every block.
+ * ANTLOC: computed before any kill. COMP: computed after the last kill.
+ * TRANSP: not killed. The first occurrence counted by ANTLOC and the last
+ * one counted by COMP are recorded as well.
+ */
+void PRE::getBlockPredicates(Function &F, const std::vector<term_t> &terms,
+                             BlockPredicates &local) {
+  unsigned numTerms = terms.size();
+  std::map<term_t, unsigned> termIndex;
+  DenseMap< Value*, std::vector<unsigned> > termsOfOperand;
+  for (unsigned i = 0; i != numTerms; ++i) {
+    termIndex[terms[i]] = i;
+    // a term is killed where any leaf under its subterms is defined, as
+    // in Transp.
+    SmallPtrSet<Value*, 4> operands;
+    SmallVector<term_t, 4> parts(1, terms[i]);
+    while (!parts.empty()) {
+      term_t part = parts.pop_back_val();
+      for (unsigned j = 0, e = term_num_operands(part); j != e; ++j) {
+        term_t subterm;
+        if (getOperandSubterm(part, j, subterm)) {
+          parts.push_back(subterm);
+        } else if (operands.insert(term_operand(part, j)).second) {
+          termsOfOperand[term_operand(part, j)].push_back(i);
+        }
+      }
+    }
+  }
+
+  for (BasicBlock &bb : F) {
+    BitVector &antloc = local.ANTLOC[&bb];
+    BitVector &comp = local.COMP[&bb];
+    BitVector &transp = local.TRANSP[&bb];
+    antloc.resize(numTerms);
+    comp.resize(numTerms);
+    transp.resize(numTerms, true);
+
+    for (Instruction &inst : bb) {
+      SmallVector<unsigned, 2> occurs;
+      term_t term;
+      if (getTerm(inst, term)) {
+        auto found = termIndex.find(term);
+        if (found != termIndex.end()) {
+          occurs.push_back(found->second);
+        }
+      }
+      // a speculative anchor counts as an occurrence of its terms
+      auto anchored = anchors.find(&inst);
+      if (anchored != anchors.end()) {
+        for (const term_t &anchor : anchored->second) {
+          auto found = termIndex.find(anchor);
+          if (found != termIndex.end()) {
+            occurs.push_back(found->second);
+          }
+        }
+      }
+      for (unsigned i : occurs) {
+        if (transp[i] && !antloc[i]) {
+          antloc.set(i);
+          local.upExposed[std::make_pair(&bb, i)] = &inst;
+        }
+        comp.set(i);
+        local.downExposed[std::make_pair(&bb, i)] = &inst;
+      }
+
+      // definitions of SSA operands
+      auto defined = termsOfOperand.find(&inst);
+      if (defined != termsOfOperand.end()) {
+        for (unsigned i : defined->second) {
+          transp.reset(i);
+          comp.reset(i);
+        }
+      }
+
+      if (!inst.mayWriteToMemory()) continue;
+      for (unsigned i = 0; i != numTerms; ++i) {
+        if (!Transp(inst, terms[i])) {
+          transp.reset(i);
+          comp.reset(i);
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Calculate anticipability of every term at the entry and exit of every
+ * block.
+ *
+ * Blocks that cannot reach an exit are solved first, from false, so that
+ * a term is anticipated there only if every path computes it within a
+ * finite number of steps, and never on a cycle that merely does not kill
+ * it. They have no successors outside themselves. The blocks that reach
+ * an exit are then solved from true as usual.
+ */
+void PRE::getAnticipability(Function &F, unsigned numTerms, BlockPredicates &local,
+                            DenseMap<BasicBlock*, BitVector> &ANTIN,
+                            DenseMap<BasicBlock*, BitVector> &ANTOUT) {
+  SmallPtrSet<BasicBlock*, 32> reachesExit;
+  std::vector<BasicBlock*> worklist;
+  for (BasicBlock &bb : F) {
+    if (succ_begin(&bb) == succ_end(&bb)) {
+      reachesExit.insert(&bb);
+      worklist.push_back(&bb);
+    }
+  }
+  while (!worklist.empty()) {
+    BasicBlock *bb = worklist.back();
+    worklist.pop_back();
+    for (BasicBlock *pred : predecessors(bb)) {
+      if (reachesExit.insert(pred).second) {
+        worklist.push_back(pred);
+      }
+    }
+  }
+
+  for (BasicBlock &bb : F) {
+    ANTIN[&bb].resize(numTerms, reachesExit.count(&bb) != 0);
+    ANTOUT[&bb].resize(numTerms);
+  }
+  ReversePostOrderTraversal<Function *> RPOT(&F);
+  std::vector<BasicBlock*> rpo(RPOT.begin(), RPOT.end());
+  for (int region = 0; region != 2; ++region) {
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (auto I = rpo.rbegin(), E = rpo.rend(); I != E; ++I) {
+        BasicBlock *bb = *I;
+        if (reachesExit.count(bb) != (region == 1)) continue;
+        BitVector antout(numTerms, succ_begin(bb) != succ_end(bb));
+        for (BasicBlock *succ : successors(bb)) {
+          antout &= ANTIN[succ];
+        }
+        ANTOUT[bb] = antout;
+        antout &= local.TRANSP[bb];
+        antout |= local.ANTLOC[bb];
+        if (antout != ANTIN[bb]) {
+          ANTIN[bb] = antout;
+          changed = true;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Calculate the placements of all terms at once on basic blocks.
+ *
+ * This is the Drechsler-Stadel variant of LCM: availability and
+ * anticipability are the only analyses that look at the whole function,
+ * Earliest is derived from them locally on each edge, and the Later
+ * system that pushes insertions down replaces Delay, Latest and Isolated.
+ * Each analysis runs on bit vectors holding every term, so the number of
+ * sweeps does not grow with the number of terms.
+ */
+void PRE::getPlacementsBitVector(Function &F, const std::vector<term_t> &terms,
+                                 std::vector<Placement> &placements) {
+  unsigned numTerms = terms.size();
+  BlockPredicates local;
+  getBlockPredicates(F, terms, local);
+  DenseMap<BasicBlock*, BitVector> &ANTLOC = local.ANTLOC;
+  DenseMap<BasicBlock*, BitVector> &COMP = local.COMP;
+  DenseMap<BasicBlock*, BitVector> &TRANSP = local.TRANSP;
+
+  ReversePostOrderTraversal<Function *> RPOT(&F);
+  std::vector<BasicBlock*> rpo(RPOT.begin(), RPOT.end());
+  BasicBlock *entry = &F.getEntryBlock();
+
+  // Availability, forward.
+  DenseMap<BasicBlock*, BitVector> AVOUT;
+  for (BasicBlock &bb : F) {
+    AVOUT[&bb].resize(numTerms, true);
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (BasicBlock *bb : rpo) {
+      BitVector avin(numTerms, bb != entry);
+      for (BasicBlock *pred : predecessors(bb)) {
+        avin &= AVOUT[pred];
+      }
+      avin &= TRANSP[bb];
+      avin |= COMP[bb];
+      if (avin != AVOUT[bb]) {
+        AVOUT[bb] = avin;
+        changed = true;
+      }
+    }
+  }
+
+  // Anticipability, backward.
+  DenseMap<BasicBlock*, BitVector> ANTIN, ANTOUT;
+  getAnticipability(F, numTerms, local, ANTIN, ANTOUT);
+
+  // Earliest, locally on each edge.
+  typedef std::pair<BasicBlock*, BasicBlock*> edge_t;
+  std::map<edge_t, BitVector> EARLIEST;
+  for (BasicBlock *bb : rpo) {
+    for (BasicBlock *succ : successors(bb)) {
+      BitVector earliest = TRANSP[bb];
+      earliest &= ANTOUT[bb];
+      earliest.flip();
+      earliest &= ANTIN[succ];
+      BitVector notAvailable = AVOUT[bb];
+      notAvailable.flip();
+      earliest &= notAvailable;
+      EARLIEST[edge_t(bb, succ)] = earliest;
+    }
+  }
+
+  // Later, forward: how far down each insertion can be pushed.
+  DenseMap<BasicBlock*, BitVector> LATERIN;
+  std::map<edge_t, BitVector> LATER;
+  for (BasicBlock &bb : F) {
+    LATERIN[&bb].resize(numTerms, true);
+  }
+  LATERIN[entry] = ANTIN[entry];
+  changed = true;
+  while (changed) {
+    changed = false;
+    for (BasicBlock *bb : rpo) {
+      BitVector laterout = ANTLOC[bb];
+      laterout.flip();
+      laterout &= LATERIN[bb];
+      for (BasicBlock *succ : successors(bb)) {
+        BitVector later = laterout;
+        later |= EARLIEST[edge_t(bb, succ)];
+        LATER[edge_t(bb, succ)] = later;
+      }
+    }
+    for (BasicBlock *bb : rpo) {
+      if (bb == entry) continue;
+      BitVector laterin(numTerms, true);
+      for (BasicBlock *pred : predecessors(bb)) {
+        auto later = LATER.find(edge_t(pred, bb));
+        if (later != LATER.end()) {
+          laterin &= later->second;
+        }
+      }
+      if (laterin != LATERIN[bb]) {
+        LATERIN[bb] = laterin;
+        changed = true;
+      }
+    }
+  }
+
+  // Insert on edges where Later stops, delete upward exposed occurrences
+  // that are covered on every incoming path.
+  std::vector<bool> feasible(numTerms, true);
+  for (auto &later : LATER) {
+    BasicBlock *from = later.first.first;
+    BasicBlock *to = later.first.second;
+    BitVector insert = LATERIN[to];
+    insert.flip();
+    insert &= later.second;
+    for (int i = insert.find_first(); i >= 0; i = insert.find_next(i)) {
+      Instruction *insertPt = getEdgeInsertionPoint(from, to);
+      if (!insertPt) {
+        DEBUG(dbgs() << "#critical edge: " << from->getName() << " -> " << to->getName() << "\n");
+        feasible[i] = false;
+        continue;
+      }
+      placements[i].OCP.insert(insertPt);
+    }
+  }
+  for (BasicBlock &bb : F) {
+    BitVector remove = LATERIN[&bb];
+    remove.flip();
+    remove &= ANTLOC[&bb];
+    for (int i = remove.find_first(); i >= 0; i = remove.find_next(i)) {
+      placements[i].RO.insert(local.upExposed[std::make_pair(&bb, (unsigned)i)]);
+    }
+  }
+
+  // The last occurrence of a block that is kept still has to leave its
+  // value in the temporary for the occurrences deleted further down.
+  for (unsigned i = 0; i != numTerms; ++i) {
+    if (!feasible[i] || placements[i].RO.empty()) {
+      placements[i].OCP.clear();
+      placements[i].RO.clear();
+      continue;
+    }
+    for (BasicBlock &bb : F) {
+      if (!COMP[&bb].test(i)) continue;
+      Instruction *inst = local.downExposed[std::make_pair(&bb, i)];
+      if (placements[i].RO.count(inst)) continue;
+      placements[i].OCP.insert(inst);
+      placements[i].RO.insert(inst);
+    }
+  }
+}
+
+namespace {
+  const uint64_t InfiniteCapacity = UINT64_MAX / 4;
+
+  // A flow network with residual capacities, for getPlacementsMinCut.
+  // Edge e^1 is the reverse of edge e.
+  struct FlowNetwork {
+    struct Edge {
+      unsigned to;
+      uint64_t capacity;
+    };
+    std::vector<Edge> edges;
+    std::vector< std::vector<unsigned> > out;
+
+    explicit FlowNetwork(unsigned numNodes) : out(numNodes) { }
+
+    unsigned addEdge(unsigned from, unsigned to, uint64_t capacity) {
+      Edge forward = { to, std::min(capacity, InfiniteCapacity) };
+      Edge backward = { from, 0 };
+      out[from].push_back(edges.size());
+      edges.push_back(forward);
+      out[to].push_back(edges.size());
+      edges.push_back(backward);
+      return edges.size() - 2;
+    }
+
+    unsigned from(unsigned e) const { return edges[e ^ 1].to; }
+
+    // Edmonds-Karp: augment along shortest paths until none is left.
+    void maxFlow(unsigned source, unsigned sink) {
+      while (true) {
+        std::vector<int> via(out.size(), -1);
+        std::vector<unsigned> queue(1, source);
+        for (unsigned head = 0; head != queue.size() && via[sink] < 0; ++head) {
+          unsigned node = queue[head];
+          for (unsigned e : out[node]) {
+            unsigned to = edges[e].to;
+            if (edges[e].capacity == 0 || to == source || via[to] >= 0) continue;
+            via[to] = e;
+            queue.push_back(to);
+          }
+        }
+        if (via[sink] < 0) {
+          return;
+        }
+        uint64_t flow = InfiniteCapacity;
+        for (unsigned node = sink; node != source; node = from(via[node])) {
+          flow = std::min(flow, edges[via[node]].capacity);
+        }
+        for (unsigned node = sink; node != source; node = from(via[node])) {
+          edges[via[node]].capacity -= flow;
+          edges[via[node] ^ 1].capacity += flow;
+        }
+      }
+    }
+
+    // Nodes that can still reach `sink` after maxFlow. The edges into them
+    // form the minimum cut that is closest to the sink.
+    std::vector<bool> sinkSide(unsigned sink) {
+      std::vector<bool> side(out.size(), false);
+      std::vector<unsigned> worklist(1, sink);
+      side[sink] = true;
+      while (!worklist.empty()) {
+        unsigned node = worklist.back();
+        worklist.pop_back();
+        for (unsigned e : out[node]) {
+          unsigned pred = edges[e].to;
+          if (side[pred] || edges[e ^ 1].capacity == 0) continue;
+          side[pred] = true;
+          worklist.push_back(pred);
+        }
+      }
+      return side;
+    }
+  };
+}
+
+/**
+ * Calculate the placements of all terms on basic blocks by a minimum cut
+ * over block frequencies (MC-PRE).
+ *
+ * For each term the network has the entry and exit of every block as
+ * nodes. A path from the source to the sink is a path on which the value
+ * is not available when an upward exposed occurrence needs it: it starts
+ * at the function entry or after a kill, runs through transparent blocks,
+ * and ends at the occurrence. Cutting a CFG edge inserts the term there
+ * and costs the edge frequency; cutting the edge of an occurrence keeps
+ * it as it is and costs its block frequency. Every insertion costs one
+ * more, so moving an occurrence without saving executions never pays.
+ * The cheapest cut may insert where the term is not anticipated, which
+ * is allowed only for terms that cannot trap. Critical edges cannot be
+ * cut unless they were split beforehand, see -pre-split-critical-edges.
+ */
+void PRE::getPlacementsMinCut(Function &F, const std::vector<term_t> &terms,
+                              std::vector<Placement> &placements) {
+  unsigned numTerms = terms.size();
+  BlockPredicates local;
+  getBlockPredicates(F, terms, local);
+  DenseMap<BasicBlock*, BitVector> ANTIN, ANTOUT;
+  getAnticipability(F, numTerms, local, ANTIN, ANTOUT);
+
+  BlockFrequencyInfo &BFI = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+  BranchProbabilityInfo &BPI = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
+
+  // node 0 is the source, 1 the sink, then the entry and exit of each block.
+  std::vector<BasicBlock*> blocks;
+  DenseMap<BasicBlock*, unsigned> blockIn;
+  for (BasicBlock &bb : F) {
+    blockIn[&bb] = 2 + 2 * blocks.size();
+    blocks.push_back(&bb);
+  }
+  BasicBlock *entry = &F.getEntryBlock();
+  const uint64_t Infinite = InfiniteCapacity;
+
+  for (unsigned i = 0; i != numTerms; ++i) {
+    Instruction *occurrence = NULL;
+    for (BasicBlock *bb : blocks) {
+      auto found = local.upExposed.find(std::make_pair(bb, i));
+      if (found != local.upExposed.end()) {
+        occurrence = found->second;
+        break;
+      }
+    }
+    if (!occurrence) continue;
+    bool speculate = Speculatable(occurrence);
+
+    FlowNetwork network(2 + 2 * blocks.size());
+    std::vector< std::pair<unsigned, Instruction*> > insertions;
+    std::vector< std::pair<unsigned, BasicBlock*> > occurrences;
+
+    unsigned edge = network.addEdge(0, blockIn[entry],
+                                    speculate || ANTIN[entry].test(i) ?
+                                    BFI.getBlockFreq(entry).getFrequency() + 1 : Infinite);
+    insertions.push_back(std::make_pair(edge, &*(entry->getFirstInsertionPt())));
+
+    for (BasicBlock *bb : blocks) {
+      unsigned in = blockIn[bb];
+      unsigned out = in + 1;
+      if (local.ANTLOC[bb].test(i)) {
+        edge = network.addEdge(in, 1, BFI.getBlockFreq(bb).getFrequency());
+        occurrences.push_back(std::make_pair(edge, bb));
+      }
+      if (local.COMP[bb].test(i)) continue; // available at the exit
+      if (!local.TRANSP[bb].test(i)) {
+        network.addEdge(0, out, Infinite);
+        continue;
+      }
+      network.addEdge(in, out, Infinite);
+    }
+
+    for (BasicBlock *bb : blocks) {
+      SmallPtrSet<BasicBlock*, 4> seen;
+      for (BasicBlock *succ : successors(bb)) {
+        if (!seen.insert(succ).second) continue;
+        Instruction *insertPt = getEdgeInsertionPoint(bb, succ);
+        uint64_t frequency = (BFI.getBlockFreq(bb) * BPI.getEdgeProbability(bb, succ)).getFrequency() + 1;
+        if (!insertPt || (!speculate && !ANTIN[succ].test(i))) {
+          frequency = Infinite;
+        }
+        edge = network.addEdge(blockIn[bb] + 1, blockIn[succ], frequency);
+        if (insertPt) {
+          insertions.push_back(std::make_pair(edge, insertPt));
+        }
+      }
+    }
+
+    network.maxFlow(0, 1);
+    std::vector<bool> sinkSide = network.sinkSide(1);
+
+    Placement &placement = placements[i];
+    for (auto &occurrence : occurrences) {
+      if (sinkSide[network.from(occurrence.first)]) {
+        placement.RO.insert(local.upExposed[std::make_pair(occurrence.second, i)]);
+      }
+    }
+    if (placement.RO.empty()) continue;
+
+    for (auto &insertion : insertions) {
+      unsigned e = insertion.first;
+      if (!sinkSide[network.from(e)] && sinkSide[network.edges[e].to]) {
+        placement.OCP.insert(insertion.second);
+      }
+    }
+
+    // Occurrences that are kept leave their value in the temporary for
+    // the ones further down.
+    for (BasicBlock *bb : blocks) {
+      if (!local.COMP[bb].test(i)) continue;
+      Instruction *inst = local.downExposed[std::make_pair(bb, i)];
+      if (placement.RO.count(inst)) continue;
+      placement.OCP.insert(inst);
+      placement.RO.insert(inst);
+    }
+    DEBUG(dbgs() << "#min cut: " << placement.OCP.size() << " insertions, "
+                 << placement.RO.size() << " replacements\n");
+  }
+}
+
+/**
+ * Anchor loop invariant terms at the preheader of loops they occur in.
+ *
+ * LCM never computes a term on a path that does not already compute it,
+ * and a `while` loop may run zero times, so a loop invariant occurrence
+ * in its body is not down-safe at the loop entry and stays in the loop.
+ * An anchor is a pretend occurrence at the preheader terminator: it makes
+ * the term down-safe there, the engines place it there, and the
+ * occurrences in the loop become fully redundant. Only terms that cannot
+ * trap are anchored, and only in loops where an occurrence runs at least
+ * as often as the preheader. Anchors are never replaced.
+ */
+void PRE::getAnchors(Function &F, const std::vector<term_t> &terms) {
+  LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+  BlockFrequencyInfo &BFI = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+
+  std::map<term_t, unsigned> termIndex;
+  for (unsigned i = 0, e = terms.size(); i != e; ++i) {
+    termIndex[terms[i]] = i;
+  }
+  std::vector<Instruction*> first(terms.size(), NULL);
+  std::vector< SmallPtrSet<BasicBlock*, 4> > occurrences(terms.size());
+  for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+    term_t term;
+    if (!getTerm(*I, term)) continue;
+    auto found = termIndex.find(term);
+    if (found == termIndex.end()) continue;
+    if (!first[found->second]) {
+      first[found->second] = &*I;
+    }
+    occurrences[found->second].insert(I->getParent());
+  }
+
+  std::vector<Loop*> loops(LI.begin(), LI.end());
+  while (!loops.empty()) {
+    Loop *L = loops.back();
+    loops.pop_back();
+    loops.insert(loops.end(), L->begin(), L->end());
+    BasicBlock *preheader = L->getLoopPreheader();
+    if (!preheader) continue;
+    uint64_t entryFrequency = BFI.getBlockFreq(preheader).getFrequency();
+
+    for (unsigned i = 0, e = terms.size(); i != e; ++i) {
+      uint64_t frequency = 0;
+      for (BasicBlock *bb : occurrences[i]) {
+        if (L->contains(bb)) {
+          frequency = std::max(frequency, BFI.getBlockFreq(bb).getFrequency());
+        }
+      }
+      if (frequency == 0 || frequency < entryFrequency ||
+          !Speculatable(first[i])) {
+        continue;
+      }
+      bool invariant = true;
+      for (auto bb = L->block_begin(), be = L->block_end(); bb != be && invariant; ++bb) {
+        for (Instruction &inst : **bb) {
+          if (!Transp(inst, terms[i])) {
+            invariant = false;
+            break;
+          }
+        }
+      }
+      if (!invariant) continue;
+
+      DEBUG(dbgs() << "#anchor in " << preheader->getName() << ": " << *first[i] << "\n");
+      anchors[preheader->getTerminator()].push_back(terms[i]);
+      NumSpeculated++;
+    }
+  }
+}
+
+/**
+ * Whether a value of `type` lives in the vector (and floating point)
+ * register file rather than in general purpose registers.
+ */
+static bool isVectorRegister(Type *type) {
+  return type->isVectorTy() || type->isFloatingPointTy();
+}
+
+/**
+ * Estimate the register pressure of every block: the largest number of
+ * SSA values live at one point, for general purpose registers in
+ * pressure[0] and vector registers in pressure[1]. Allocas are frame
+ * addresses and do not count.
+ */
+void PRE::getRegisterPressure(Function &F, DenseMap<BasicBlock*, unsigned> *pressure) {
+  DenseMap<Value*, unsigned> numbers;
+  std::vector<bool> vector;
+  for (Argument &arg : F.args()) {
+    numbers[&arg] = vector.size();
+    vector.push_back(isVectorRegister(arg.getType()));
+  }
+  for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+    if (I->getType()->isVoidTy() || isa<AllocaInst>(*I)) continue;
+    numbers[&*I] = vector.size();
+    vector.push_back(isVectorRegister(I->getType()));
+  }
+  unsigned numValues = vector.size();
+
+  // Liveness, backward. A PHI uses its incoming value at the end of the
+  // incoming block.
+  DenseMap<BasicBlock*, BitVector> USE, DEF, PHIUSE, LIVEIN, LIVEOUT;
+  for (BasicBlock &bb : F) {
+    BitVector &use = USE[&bb];
+    BitVector &def = DEF[&bb];
+    use.resize(numValues);
+    def.resize(numValues);
+    PHIUSE[&bb].resize(numValues);
+    LIVEIN[&bb].resize(numValues);
+    LIVEOUT[&bb].resize(numValues);
+    for (Instruction &inst : bb) {
+      if (PHINode *phi = dyn_cast<PHINode>(&inst)) {
+        for (unsigned i = 0, e = phi->getNumIncomingValues(); i != e; ++i) {
+          auto found = numbers.find(phi->getIncomingValue(i));
+          if (found != numbers.end()) {
+            PHIUSE[phi->getIncomingBlock(i)].resize(numValues);
+            PHIUSE[phi->getIncomingBlock(i)].set(found->second);
+          }
+        }
+      } else {
+        for (Value *operand : inst.operands()) {
+          auto found = numbers.find(operand);
+          if (found != numbers.end() && !def.test(found->second)) {
+            use.set(found->second);
+          }
+        }
+      }
+      auto found = numbers.find(&inst);
+      if (found != numbers.end()) {
+        def.set(found->second);
+      }
+    }
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (po_iterator<BasicBlock *> I = po_begin(&F.getEntryBlock()),
+                                  IE = po_end(&F.getEntryBlock());
+                                 I != IE; ++I) {
+      BasicBlock *bb = *I;
+      BitVector liveout = PHIUSE[bb];
+      for (BasicBlock *succ : successors(bb)) {
+        liveout |= LIVEIN[succ];
+      }
+      BitVector livein = liveout;
+      livein.reset(DEF[bb]);
+      livein |= USE[bb];
+      LIVEOUT[bb] = liveout;
+      if (livein != LIVEIN[bb]) {
+        LIVEIN[bb] = livein;
+        changed = true;
+      }
+    }
+  }
+
+  // The largest number of values live at once, walking each block up.
+  for (BasicBlock &bb : F) {
+    BitVector live = LIVEOUT[&bb];
+    unsigned count[2] = { 0, 0 };
+    for (int n = live.find_first(); n >= 0; n = live.find_next(n)) {
+      count[vector[n]]++;
+    }
+    unsigned largest[2] = { count[0], count[1] };
+    for (auto it = bb.rbegin(), ite = bb.rend(); it != ite && !isa<PHINode>(*it); ++it) {
+      auto found = numbers.find(&*it);
+      if (found != numbers.end() && live.test(found->second)) {
+        live.reset(found->second);
+        count[vector[found->second]]--;
+      }
+      for (Value *operand : it->operands()) {
+        auto used = numbers.find(operand);
+        if (used != numbers.end() && !live.test(used->second)) {
+          live.set(used->second);
+          count[vector[used->second]]++;
+        }
+      }
+      largest[0] = std::max(largest[0], count[0]);
+      largest[1] = std::max(largest[1], count[1]);
+    }
+    pressure[0][&bb] = largest[0];
+    pressure[1][&bb] = largest[1];
+  }
+}
+
+/**
+ * Keep temporaries out of blocks that have no register left for them.
+ *
+ * The temporary of a term is live from an OCP to each redundant
+ * occurrence it feeds. Terms are visited from the most to the least
+ * expensive to recompute, so that a costly term is not left out for a
+ * cheap lane shuffle, and occurrences in program order; a redundant
+ * occurrence whose temporary would be live in a block already at the
+ * register count of its class keeps its own computation instead.
+ * Insertions that are left feeding nothing are dropped, and a term with
+ * nothing left to replace is declined. Both cases are reported as missed
+ * optimizations.
+ */
+void PRE::limitRegisterPressure(Function &F, const std::vector<term_t> &terms,
+                                std::vector<Placement> &placements) {
+  bool placed = false;
+  for (const Placement &placement : placements) {
+    placed = placed || !placement.RO.empty();
+  }
+  if (!placed) return;
+
+  const TargetTransformInfo &TTI = getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+  OptimizationRemarkEmitter &ORE = getAnalysis<OptimizationRemarkEmitterWrapperPass>().getORE();
+  DenseMap<BasicBlock*, unsigned> pressure[2];
+  getRegisterPressure(F, pressure);
+
+  DenseMap<Instruction*, unsigned> positions;
+  std::vector<Instruction*> program;
+  for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+    positions[&*I] = program.size();
+    program.push_back(&*I);
+  }
+
+  // by decreasing cost, then by term number.
+  std::vector< std::pair<int, unsigned> > order;
+  for (unsigned i = 0, e = terms.size(); i != e; ++i) {
+    if (placements[i].RO.empty()) continue;
+    order.push_back(std::make_pair(-(int)getCost(TTI, **placements[i].RO.begin()), i));
+  }
+  std::sort(order.begin(), order.end());
+
+  for (auto &cost : order) {
+    unsigned i = cost.second;
+    Placement &placement = placements[i];
+    unsigned vector = isVectorRegister(term_type(terms[i]));
+    unsigned limit = TTI.getNumberOfRegisters(vector);
+
+    DenseMap<BasicBlock*, std::vector<Instruction*> > insertions;
+    for (auto inst : placement.OCP) {
+      insertions[inst->getParent()].push_back(inst);
+    }
+
+    std::vector<Instruction*> replaced;
+    for (Instruction *inst : program) {
+      if (placement.RO.count(inst) && !placement.OCP.count(inst)) {
+        replaced.push_back(inst);
+      }
+    }
+
+    std::set<Instruction*> feeding;
+    unsigned kept = 0;
+    for (Instruction *inst : replaced) {
+      // blocks the temporary is live in on the way up to the OCPs.
+      SmallPtrSet<BasicBlock*, 8> live;
+      SmallVector<BasicBlock*, 8> worklist;
+      BasicBlock *bb = inst->getParent();
+      live.insert(bb);
+      bool local = false;
+      for (Instruction *insertPt : insertions.lookup(bb)) {
+        local = local || positions[insertPt] < positions[inst];
+      }
+      if (!local) {
+        worklist.append(pred_begin(bb), pred_end(bb));
+      }
+      while (!worklist.empty()) {
+        BasicBlock *pred = worklist.back();
+        worklist.pop_back();
+        if (!live.insert(pred).second) continue;
+        if (insertions.count(pred)) continue;
+        worklist.append(pred_begin(pred), pred_end(pred));
+      }
+
+      bool fits = true;
+      for (BasicBlock *block : live) {
+        fits = fits && pressure[vector][block] + 1 <= limit;
+      }
+      if (!fits) {
+        placement.RO.erase(inst);
+        NumPressureShortened++;
+        continue;
+      }
+      for (BasicBlock *block : live) {
+        pressure[vector][block]++;
+        for (Instruction *insertPt : insertions.lookup(block)) {
+          feeding.insert(insertPt);
+        }
+      }
+      kept++;
+    }
+
+    if (kept == replaced.size()) continue;
+    Instruction *occurrence = replaced.front();
+    if (kept == 0) {
+      DEBUG(dbgs() << "#declined for register pressure: " << *occurrence << "\n");
+      ORE.emit(OptimizationRemarkMissed(DEBUG_TYPE, "RegisterPressure", occurrence)
+               << "not placed: its temporary would be live where all "
+               << std::to_string(limit) << " registers are taken");
+      placement.OCP.clear();
+      placement.RO.clear();
+      NumPressureDeclined++;
+      continue;
+    }
+    ORE.emit(OptimizationRemarkMissed(DEBUG_TYPE, "RegisterPressure", occurrence)
+             << std::to_string(replaced.size() - kept) << " of "
+             << std::to_string(replaced.size())
+             << " redundant occurrences kept: all registers are taken on the way");
+    for (auto it = placement.OCP.begin(); it != placement.OCP.end(); ) {
+      Instruction *insertPt = *it++;
+      if (!placement.RO.count(insertPt) && !feeding.count(insertPt)) {
+        placement.OCP.erase(insertPt);
+      }
+    }
+  }
+}
+
+/**
+ * Find the value memory operand `operand` holds right before `insertPt`:
+ * a load of it or the value last stored to it, earlier in the block with
+ * nothing in between that may write it or orders memory. Stores to other
+ * allocas and globals, such as the temporaries, are passed over.
+ * Return NULL if there is none within the scan limit.
+ */
+Value* PRE::getAvailableValue(Value *operand, Instruction *insertPt) {
+  Type* type = cast<PointerType>(operand->getType())->getElementType();
+  unsigned scanned = 0;
+  for (Instruction *inst = insertPt->getPrevNode(); inst && scanned != MaxReuseScan;
+       inst = inst->getPrevNode(), ++scanned) {
+    if (LoadInst *loadInst = dyn_cast<LoadInst>(inst)) {
+      // an ordered load is a kill to Transp as well.
+      if (!loadInst->isSimple()) {
+        return NULL;
+      }
+      if (loadInst->getPointerOperand() == operand && loadInst->getType() == type) {
+        Value* replaced = replacedValues.lookup(loadInst);
+        return replaced ? replaced : loadInst;
+      }
+    } else if (StoreInst *storeInst = dyn_cast<StoreInst>(inst)) {
+      Value* pointer = storeInst->getPointerOperand();
+      if (pointer == operand) {
+        if (!storeInst->isSimple() || storeInst->getValueOperand()->getType() != type) {
+          return NULL;
+        }
+        return storeInst->getValueOperand();
+      }
+      if (!storeInst->isSimple() ||
+          !(isa<AllocaInst>(pointer) || isa<GlobalVariable>(pointer)) ||
+          !(isa<AllocaInst>(operand) || isa<GlobalVariable>(operand))) {
+        return NULL;
+      }
+    } else if (inst->mayWriteToMemory()) {
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Load operand `i` of `term` right before `insertPt`.
+ * Operands that live in memory are loaded unless their value is already
+ * available there, values are used as they are.
+ * An SSA operand that is itself a redundant occurrence of another term
+ * may already have been replaced by a load of that term's temporary. A
+ * subterm is computed again, unless it was just inserted at `insertPt`.
+ */
+Value* PRE::materializeOperand(term_t term, unsigned i, Instruction *insertPt) {
+  Value* operand = term_operand(term, i);
+  if (term_operand_in_memory(term, i)) {
+    Value* available = getAvailableValue(operand, insertPt);
+    if (available) {
+      NumLoadsReused++;
+      return available;
+    }
+    return dyn_cast<Value>(new LoadInst(operand, Twine(), insertPt));
+  }
+  term_t subterm;
+  if (getOperandSubterm(term, i, subterm)) {
+    Value* inserted = insertedValues.lookup(subterm);
+    return inserted ? inserted : materializeTerm(subterm, insertPt);
+  }
+  auto replaced = replacedValues.find(operand);
+  if (replaced != replacedValues.end()) {
+    return replaced->second;
+  }
+  return operand;
+}
+
+/**
+ * Compute `term` from its operands right before `insertPt`, with the
+ * flags all its occurrences agree on.
+ */
+Value* PRE::materializeTerm(term_t term, Instruction *insertPt) {
+  SmallVector<Value*, 3> operands;
+  DEBUG(dbgs() << "#insert\n");
+  for (unsigned i = 0, e = term_num_operands(term); i != e; ++i) {
+    Value* operand = materializeOperand(term, i, insertPt);
+    DEBUG(dbgs() << *operand << " " << *(operand->getType()) << "\n");
+    operands.push_back(operand);
+  }
+
+  unsigned opcode = term_opcode(term);
+  Instruction *inserted;
+  if (Instruction::isBinaryOp(opcode)) {
+    inserted = BinaryOperator::Create((Instruction::BinaryOps)opcode, operands[0], operands[1], Twine(), insertPt);
+  } else if (Instruction::isCast(opcode)) {
+    inserted = CastInst::Create((Instruction::CastOps)opcode, operands[0], term_type(term), Twine(), insertPt);
+  } else if (opcode == Instruction::ICmp || opcode == Instruction::FCmp) {
+    inserted = CmpInst::Create((Instruction::OtherOps)opcode, (CmpInst::Predicate)term_predicate(term),
+                               operands[0], operands[1], Twine(), insertPt);
+  } else if (opcode == Instruction::Load) {
+    Value* pointer = operands[0];
+    inserted = new LoadInst(pointer, Twine(), insertPt);
+  } else if (opcode == Instruction::GetElementPtr) {
+    inserted = GetElementPtrInst::Create(term_source_type(term), operands[0],
+                                         makeArrayRef(operands).slice(1), Twine(), insertPt);
+  } else if (opcode == Instruction::ExtractElement) {
+    inserted = ExtractElementInst::Create(operands[0], operands[1], Twine(), insertPt);
+  } else if (opcode == Instruction::InsertElement) {
+    inserted = InsertElementInst::Create(operands[0], operands[1], operands[2], Twine(), insertPt);
+  } else if (opcode == Instruction::ShuffleVector) {
+    inserted = new ShuffleVectorInst(operands[0], operands[1], operands[2], Twine(), insertPt);
+  } else {
+    assert(opcode == Instruction::Select && "unexpected term");
+    inserted = SelectInst::Create(operands[0], operands[1], operands[2], Twine(), insertPt);
+  }
+  auto flags = insertedFlags.find(term);
+  if (flags != insertedFlags.end()) {
+    flags->second.apply(inserted);
+  }
+  return inserted;
+}
+
+/**
+ * Find the injuries of `term` its temporary has to follow, that is the
+ * ones after which a redundant occurrence may still read the temporary
+ * before an OCP computes it again.
+ */
+void PRE::getInjuries(Function &F, term_t term, const Placement &placement,
+                      std::vector< std::pair<Instruction*, Injury> > &injuries) {
+  DenseMap<BasicBlock*, bool> liveIn;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (po_iterator<BasicBlock *> I = po_begin(&F.getEntryBlock()),
+                                  IE = po_end(&F.getEntryBlock());
+                                 I != IE; ++I) {
+      BasicBlock *bb = *I;
+      bool live = false;
+      for (BasicBlock *succ : successors(bb)) {
+        live = live || liveIn[succ];
+      }
+      for (auto it = bb->rbegin(), ite = bb->rend(); it != ite; ++it) {
+        if (placement.RO.count(&*it)) live = true;
+        if (placement.OCP.count(&*it)) live = false;
+      }
+      if (live && !liveIn[bb]) {
+        liveIn[bb] = true;
+        changed = true;
+      }
+    }
+  }
+
+  for (BasicBlock &bb : F) {
+    bool live = false;
+    for (BasicBlock *succ : successors(&bb)) {
+      live = live || liveIn[succ];
+    }
+    for (auto it = bb.rbegin(), ite = bb.rend(); it != ite; ++it) {
+      Injury injury;
+      if (live && Injures(*it, term, injury)) {
+        injuries.push_back(std::make_pair(&*it, injury));
+      }
+      if (placement.RO.count(&*it)) live = true;
+      if (placement.OCP.count(&*it)) live = false;
+    }
+  }
+}
+
+/**
+ * Add step times the other factor of `term` to its temporary right
+ * before `insertPt`, which follows the injury.
+ */
+void PRE::followInjury(term_t term, const Injury &injury, AllocaInst *temporary,
+                       Instruction *insertPt) {
+  unsigned other = 1 - injury.operand;
+  Value *product = new LoadInst(temporary, Twine(), insertPt);
+  Value *factor = term_operand(term, other);
+  Instruction *updated;
+  if (!term_operand_in_memory(term, other) && isa<Constant>(factor)) {
+    Constant *increment = ConstantExpr::getMul(injury.step, cast<Constant>(factor));
+    updated = BinaryOperator::Create(Instruction::Add, product, increment, Twine(), insertPt);
+  } else {
+    factor = materializeOperand(term, other, insertPt);
+    updated = BinaryOperator::Create(injury.step->isOne() ? Instruction::Add : Instruction::Sub,
+                                     product, factor, Twine(), insertPt);
+  }
+  new StoreInst(updated, temporary, insertPt);
+  DEBUG(dbgs() << "#follow injury: " << *updated << "\n");
+  NumInjuriesUpdated++;
+}
+
+/**
+ * Perform OCP-RO Transformation for all terms at once.
+ *
+ * The placements were all solved on the original function, so the edits
+ * are collected per instruction and applied in a single sweep. Where the
+ * edits of several terms meet at one instruction, the insertions go first
+ * in term order and the instruction is replaced last. Replaced
+ * instructions are erased only after the sweep, so an insertion point is
+ * never an instruction that has already been removed.
+ *
+ * An inserted computation stands for every occurrence it replaces, so it
+ * only keeps the nsw/nuw/exact/inbounds and fast-math flags they all have.
+ * The subterms rebuilt under it keep the flags of every computation of
+ * those subterms.
+ */
+bool PRE::perform_OCP_RO_Transformation(Function &F, const std::vector<term_t> &terms,
+                                        const std::vector<Placement> &placements,
+                                        std::vector<AllocaInst*> &temporaries) {
+  // Terms to compute into their temporary before an instruction, the
+  // term whose temporary replaces the instruction, and the strength
+  // reduced terms whose temporary follows the injury it makes.
+  struct InstEdits {
+    std::vector<unsigned> inserts;
+    std::vector<Instruction*> subterms;
+    std::vector< std::pair<unsigned, Injury> > updates;
+    int replace;
+    InstEdits() : replace(-1) { }
+  };
+  DenseMap<Instruction*, InstEdits> edits;
+  SmallPtrSet<BasicBlock*, 16> editedBlocks;
+  temporaries.assign(terms.size(), NULL);
+
+  // insert instruction that is both earliest and
+  // and update term to load inst
+  Instruction *firstInst = &(F.front().front());
+  for (unsigned i = 0, e = terms.size(); i != e; ++i) {
+    const Placement &placement = placements[i];
+    if (placement.OCP.empty() || placement.RO.empty()) continue;
+
+    temporaries[i] = new AllocaInst(term_type(terms[i]), Twine(), firstInst);  // alloca inst for term.
+    for (auto inst : placement.OCP) {
+      InstEdits &edit = edits[inst];
+      edit.inserts.push_back(i);
+      editedBlocks.insert(inst->getParent());
+      // the subterms `inst` uses have their value right before it.
+      if (edit.inserts.size() == 1 && !isa<PHINode>(inst) && !inst->isEHPad()) {
+        for (Value *operand : inst->operands()) {
+          Instruction *operandInst = dyn_cast<Instruction>(operand);
+          Value *subterm = operandInst ? subtermOf.lookup(operandInst) : NULL;
+          if (subterm && (!memorySubterms.count(subterm) ||
+                          !isWrittenBetween(operandInst, inst))) {
+            edit.subterms.push_back(operandInst);
+          }
+        }
+      }
+    }
+    for (auto inst : placement.RO) {
+      edits[inst].replace = i;
+      editedBlocks.insert(inst->getParent());
+    }
+    if (EnableStrengthReduction && term_opcode(terms[i]) == Instruction::Mul) {
+      std::vector< std::pair<Instruction*, Injury> > injuries;
+      getInjuries(F, terms[i], placement, injuries);
+      for (auto &injury : injuries) {
+        edits[injury.first].updates.push_back(std::make_pair(i, injury.second));
+        editedBlocks.insert(injury.first->getParent());
+      }
+    }
+  }
+
+  if (edits.empty()) return false;
+
+  // a rebuilt subterm stands for the subterm wherever it is computed.
+  insertedFlags.clear();
+  for (unsigned i = 0, e = terms.size(); i != e; ++i) {
+    if (!temporaries[i]) continue;
+    for (auto inst : placements[i].RO) {
+      insertedFlags[terms[i]].intersect(inst);
+    }
+  }
+  for (auto &subterm : subtermOf) {
+    if (subterm.second) {
+      insertedFlags[subterms[subterm.second]].intersect(subterm.first);
+    }
+  }
+
+  replacedValues.clear();
+  for (BasicBlock &bb : F) {
+    if (!editedBlocks.count(&bb)) continue;
+
+    for (auto it = bb.begin(), ite = bb.end(); it != ite; ) {
+      Instruction * inst = &*it++;
+      auto edit = edits.find(inst);
+      if (edit == edits.end()) continue;
+
+      // Latest at a PHI means the entry of its block.
+      Instruction *insertPt = inst;
+      if (isa<PHINode>(inst) || inst->isEHPad()) {
+        insertPt = &*(bb.getFirstInsertionPt());
+      }
+      insertedValues.clear();
+      for (Instruction *operandInst : edit->second.subterms) {
+        Value* value = replacedValues.lookup(operandInst);
+        insertedValues[subterms[subtermOf[operandInst]]] = value ? value : operandInst;
+      }
+      for (unsigned i : edit->second.inserts) {
+        Value* binaryOperator = materializeTerm(terms[i], insertPt);
+        (void)dyn_cast<Value>(new StoreInst(binaryOperator, temporaries[i], insertPt));
+        insertedValues[terms[i]] = binaryOperator;
+        NumInstInserted++;
+      }
+      insertedValues.clear();
+
+      if (edit->second.replace >= 0) {
+        Value* allocaInst = temporaries[edit->second.replace];
+        DEBUG(dbgs() << "@@ " << *allocaInst << "\n");
+        Instruction* loadInst = new LoadInst(allocaInst, Twine(), inst);
+        loadInst->takeName(inst);
+        loadInst->setDebugLoc(inst->getDebugLoc());
+        DEBUG(dbgs() << "    replace to: " << *loadInst << "\n");
+
+        inst->replaceAllUsesWith(loadInst); // replace with load instruction.
+        replacedValues[inst] = loadInst;
+        NumInstReplaced++;
+      }
+
+      // an injury is a store, so it is never the last instruction.
+      for (auto &update : edit->second.updates) {
+        followInjury(terms[update.first], update.second,
+                     temporaries[update.first], &*it);
+      }
+    }
+  }
+
+  for (auto &replaced : replacedValues) {
+    cast<Instruction>(replaced.first)->eraseFromParent();
+  }
+  replacedValues.clear();
+  insertedFlags.clear();
+  DEBUG(dbgs() << "\n#Done perform_OCP_RO_Transformation\n");
+  return true;
+}
+
+/**
+ * Let temporaries of the same type that are never live at the same time
+ * share a stack slot, so that a function with many transformed terms
+ * keeps a small frame when the temporaries are not promoted.
+ *
+ * A temporary is live from a store to the loads it reaches. Two
+ * temporaries interfere if one of them is live right after a store to
+ * the other. Slots are handed out greedily in term order.
+ */
+void PRE::coalesceTemporaries(Function &F, std::vector<AllocaInst*> &temporaries) {
+  DenseMap<Value*, unsigned> numbers;
+  std::vector<AllocaInst*> slots;
+  for (AllocaInst *temporary : temporaries) {
+    if (temporary) {
+      numbers[temporary] = slots.size();
+      slots.push_back(temporary);
+    }
+  }
+  unsigned count = slots.size();
+  if (count < 2) return;
+
+  DenseMap<BasicBlock*, BitVector> liveIn;
+  std::vector<BitVector> interferes(count, BitVector(count));
+  for (int round = 0; round != 2; ++round) {
+    // the first round finds the live-in sets, the second the interference
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (po_iterator<BasicBlock *> I = po_begin(&F.getEntryBlock()),
+                                    IE = po_end(&F.getEntryBlock());
+                                   I != IE; ++I) {
+        BasicBlock *bb = *I;
+        BitVector live(count);
+        for (BasicBlock *succ : successors(bb)) {
+          if (liveIn.count(succ)) {
+            live |= liveIn[succ];
+          }
+        }
+        for (auto it = bb->rbegin(), ite = bb->rend(); it != ite; ++it) {
+          if (StoreInst *storeInst = dyn_cast<StoreInst>(&*it)) {
+            auto found = numbers.find(storeInst->getPointerOperand());
+            if (found == numbers.end()) continue;
+            if (round == 1) {
+              for (int j = live.find_first(); j >= 0; j = live.find_next(j)) {
+                interferes[found->second].set(j);
+                interferes[j].set(found->second);
+              }
+            }
+            live.reset(found->second);
+          } else if (LoadInst *loadInst = dyn_cast<LoadInst>(&*it)) {
+            auto found = numbers.find(loadInst->getPointerOperand());
+            if (found != numbers.end()) {
+              live.set(found->second);
+            }
+          }
+        }
+        if (round == 0 && (!liveIn.count(bb) || liveIn[bb] != live)) {
+          liveIn[bb] = live;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  std::vector<BitVector> members;
+  std::vector<AllocaInst*> shared;
+  for (unsigned i = 0; i != count; ++i) {
+    unsigned slot = 0;
+    for (; slot != shared.size(); ++slot) {
+      if (shared[slot]->getAllocatedType() == slots[i]->getAllocatedType() &&
+          !interferes[i].anyCommon(members[slot])) {
+        break;
+      }
+    }
+    if (slot == shared.size()) {
+      shared.push_back(slots[i]);
+      members.push_back(BitVector(count));
+    } else {
+      slots[i]->replaceAllUsesWith(shared[slot]);
+      slots[i]->eraseFromParent();
+      NumSlotsShared++;
+    }
+    members[slot].set(i);
+  }
+
+  for (AllocaInst *&temporary : temporaries) {
+    if (!temporary) continue;
+    for (unsigned slot = 0; slot != shared.size(); ++slot) {
+      if (members[slot].test(numbers[temporary])) {
+        temporary = shared[slot];
+        break;
+      }
+    }
+  }
+}
+
+namespace {
+  typedef ScopedHashTable< term_t, std::pair<Instruction*, unsigned> > AvailableTermsTy;
+  typedef ScopedHashTable< Value*, unsigned > OperandKillsTy;
+
+  // One block on the dominator tree walk of eliminateFullyRedundant.
+  // The scopes are closed when the node is popped, which drops everything
+  // the block made available before its siblings are visited. `Barrier`
+  // is the generation of the last write to unknown memory and `LastWrite`
+  // that of the last write of any kind, which is what kills a load term.
+  struct DomScope {
+    DomScope(AvailableTermsTy &Terms, OperandKillsTy &Kills,
+             DomTreeNode *N, unsigned Barrier, unsigned LastWrite)
+      : TermScope(Terms), KillScope(Kills), Node(N),
+        Child(N->begin()), Barrier(Barrier), LastWrite(LastWrite),
+        Processed(false) { }
+
+    AvailableTermsTy::ScopeTy TermScope;
+    OperandKillsTy::ScopeTy KillScope;
+    DomTreeNode *Node;
+    DomTreeNode::iterator Child;
+    unsigned Barrier;
+    unsigned LastWrite;
+    bool Processed;
+  };
+}
+
+/**
+ * Remove occurrences that are dominated by an identical computation
+ * with no kill of its operands in between.
+ *
+ * Every memory write is treated as a kill here, except that a call of a
+ * summarized function kills just the globals it writes. That is never
+ * less conservative than Transp, so the occurrences left for LCM are the
+ * partially redundant ones plus whatever this walk cannot prove.
+ */
+bool PRE::eliminateFullyRedundant(Function &F, DominatorTree &DT) {
+  bool Changed = false;
+  AvailableTermsTy AvailableTerms;
+  OperandKillsTy OperandKills;
+  unsigned CurrentGeneration = 0;
+  std::vector<WeakVH> deadOperands;
+
+  std::vector<DomScope*> stack;
+  stack.push_back(new DomScope(AvailableTerms, OperandKills, DT.getRootNode(), 0, 0));
+
+  while (!stack.empty()) {
+    DomScope *scope = stack.back();
+
+    if (!scope->Processed) {
+      scope->Processed = true;
+      BasicBlock *bb = scope->Node->getBlock();
+
+      // Paths from the immediate dominator may pass kills that are not on
+      // the dominator tree path, so nothing loaded from memory survives
+      // into a join point.
+      if (!bb->getSinglePredecessor()) {
+        scope->Barrier = scope->LastWrite = ++CurrentGeneration;
+      }
+
+      for (auto it = bb->begin(), ite = bb->end(); it != ite; ) {
+        Instruction *inst = &*it++;
+
+        StoreInst* storeInst = dyn_cast<StoreInst>(inst);
+        CallInst* callInst = dyn_cast<CallInst>(inst);
+        Function* callee = callInst ? callInst->getCalledFunction() : NULL;
+        if (storeInst && (isa<AllocaInst>(storeInst->getPointerOperand()) ||
+                          isa<GlobalValue>(storeInst->getPointerOperand()))) {
+          OperandKills.insert(storeInst->getPointerOperand(), ++CurrentGeneration);
+          scope->LastWrite = CurrentGeneration;
+          continue;
+        } else if (callInst && callInst->onlyAccessesInaccessibleMemory()) {
+          continue;
+        } else if (callee && inst->mayWriteToMemory() && !getModRefSummary(callee).unknown) {
+          // a summarized callee writes no stack slot of ours, only globals.
+          for (GlobalValue *global : getModRefSummary(callee).globals) {
+            OperandKills.insert(global, ++CurrentGeneration);
+            scope->LastWrite = CurrentGeneration;
+          }
+          continue;
+        } else if (inst->mayWriteToMemory()) {
+          scope->Barrier = scope->LastWrite = ++CurrentGeneration;
+          continue;
+        }
+
+        term_t term;
+        if (!getTerm(*inst, term)) continue;
+
+        std::pair<Instruction*, unsigned> leader = AvailableTerms.lookup(term);
+        bool available = leader.first != NULL;
+        // the leaves of the subterms have to survive as well.
+        SmallVector<term_t, 4> parts(1, term);
+        while (available && !parts.empty()) {
+          term_t part = parts.pop_back_val();
+          if (term_opcode(part) == Instruction::Load && leader.second < scope->LastWrite) {
+            available = false;
+          }
+          for (unsigned i = 0, e = term_num_operands(part); i != e && available; ++i) {
+            term_t subterm;
+            if (getOperandSubterm(part, i, subterm)) {
+              parts.push_back(subterm);
+              continue;
+            }
+            if (!term_operand_in_memory(part, i)) continue;
+            if (leader.second < scope->Barrier ||
+                leader.second < OperandKills.lookup(term_operand(part, i))) {
+              available = false;
+            }
+          }
+        }
+
+        if (!available) {
+          AvailableTerms.insert(term, std::make_pair(inst, CurrentGeneration));
+          continue;
+        }
+
+        DEBUG(dbgs() << "#fully redundant: " << *inst << "\n    leader: " << *leader.first << "\n");
+        leader.first->andIRFlags(inst);
+        inst->replaceAllUsesWith(leader.first);
+        // a dead operand may be the leader of another term still in the
+        // table, so operands are only cleaned up after the walk.
+        for (Value *operand : inst->operands()) {
+          deadOperands.push_back(WeakVH(operand));
+        }
+        inst->eraseFromParent();
+        NumFullyRedundant++;
+        Changed = true;
+      }
+    }
+
+    if (scope->Child != scope->Node->end()) {
+      DomTreeNode *child = *(scope->Child++);
+      stack.push_back(new DomScope(AvailableTerms, OperandKills, child,
+                                   scope->Barrier, scope->LastWrite));
+    } else {
+      stack.pop_back();
+      delete scope;
+    }
+  }
+
+  for (WeakVH &operand : deadOperands) {
+    if (operand) {
+      RecursivelyDeleteTriviallyDeadInstructions(operand);
+    }
+  }
+  return Changed;
+}
+
+/**
+ * Pick the engine for `F` from its instruction count, block count,
+ * term count and loop depth, unless -pre-engine names one.
+ *
+ * The per-term engine revisits every instruction for every term, about
+ * once per loop level until it settles, so it is kept for small
+ * functions. The bit-vector engine grows with blocks times terms. Beyond
+ * that only the dominator prepass runs. A function with a profile goes to
+ * the min-cut engine first, if it is within that engine's budget.
+ */
+LCMEngine PRE::selectEngine(Function &F, unsigned numTerms) {
+  if (Engine != AutoEngine) {
+    return Engine;
+  }
+
+  uint64_t numInsts = 0;
+  uint64_t numBlocks = 0;
+  unsigned loopDepth = 0;
+  LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+  for (BasicBlock &bb : F) {
+    numInsts += bb.size();
+    numBlocks++;
+    loopDepth = std::max(loopDepth, LI.getLoopDepth(&bb));
+  }
+  DEBUG(dbgs() << "#measure: " << numInsts << " insts, " << numBlocks << " blocks, "
+               << numTerms << " terms, loop depth " << loopDepth << "\n");
+
+  if (numTerms == 0) {
+    return SkipEngine;
+  }
+  // with a profile, frequencies say where speculation pays off.
+  if (F.getEntryCount() && numBlocks * numTerms <= MinCutBudget) {
+    return MinCutEngine;
+  }
+  if (numInsts * numTerms * (loopDepth + 1) <= PerTermBudget) {
+    return PerTermEngine;
+  }
+  if (numBlocks * numTerms <= BitVectorBudget) {
+    return BitVectorEngine;
+  }
+  return SparseEngine;
+}
+
+namespace {
+  // Numbers values and types for getFingerprint. Local values are numbered
+  // by position, constants once per module, everything else by first
+  // appearance, and a type is spelled out structurally the first time it
+  // is seen.
+  struct FingerprintBuilder {
+    std::vector<unsigned> &out;
+    DenseMap<void*, unsigned> &attributes;
+    DenseMap<Constant*, unsigned> &constants;
+    DenseMap<Value*, unsigned> locals;
+    DenseMap<Value*, unsigned> others;
+    DenseMap<Type*, unsigned> types;
+
+    FingerprintBuilder(std::vector<unsigned> &out, DenseMap<void*, unsigned> &attributes,
+                       DenseMap<Constant*, unsigned> &constants)
+      : out(out), attributes(attributes), constants(constants) { }
+
+    // attribute lists are uniqued, so equal lists have one number.
+    void addAttributes(void *list) {
+      auto number = attributes.insert(std::make_pair(list, attributes.size()));
+      out.push_back(number.first->second);
+    }
+
+    void addType(Type *type) {
+      auto found = types.find(type);
+      if (found != types.end()) {
+        out.push_back(found->second);
+        return;
+      }
+      unsigned number = types.size() + 1;
+      types[type] = number;
+      out.push_back(0);
+      out.push_back(type->getTypeID());
+      if (IntegerType *intType = dyn_cast<IntegerType>(type)) {
+        out.push_back(intType->getBitWidth());
+      } else if (PointerType *ptrType = dyn_cast<PointerType>(type)) {
+        out.push_back(ptrType->getAddressSpace());
+      } else {
+        if (ArrayType *arrayType = dyn_cast<ArrayType>(type)) {
+          out.push_back(arrayType->getNumElements());
+        } else if (VectorType *vectorType = dyn_cast<VectorType>(type)) {
+          out.push_back(vectorType->getNumElements());
+        } else if (StructType *structType = dyn_cast<StructType>(type)) {
+          out.push_back(structType->isPacked());
+        }
+        out.push_back(type->getNumContainedTypes());
+        for (Type *contained : type->subtypes()) {
+          addType(contained);
+        }
+      }
+    }
+
+    void addValue(Value *val) {
+      auto local = locals.find(val);
+      if (local != locals.end()) {
+        out.push_back(1);
+        out.push_back(local->second);
+        return;
+      }
+      // constants are uniqued, so equal constants have one number. Their
+      // value decides whether a division may trap, or what an index costs.
+      Constant *constant = dyn_cast<Constant>(val);
+      if (constant && !isa<GlobalValue>(constant)) {
+        auto number = constants.insert(std::make_pair(constant, constants.size()));
+        out.push_back(3);
+        out.push_back(number.first->second);
+        return;
+      }
+      auto found = others.find(val);
+      bool first = found == others.end();
+      if (first) {
+        found = others.insert(std::make_pair(val, others.size())).first;
+      }
+      out.push_back(2);
+      out.push_back(found->second);
+      addType(val->getType());
+      // what alias analysis and speculation know about a global.
+      if (!first) return;
+      if (GlobalObject *object = dyn_cast<GlobalObject>(val)) {
+        out.push_back(object->getLinkage());
+        out.push_back(object->getAlignment());
+      }
+      if (GlobalVariable *global = dyn_cast<GlobalVariable>(val)) {
+        out.push_back(global->isConstant());
+      } else if (Function *function = dyn_cast<Function>(val)) {
+        addAttributes(function->getAttributes().getRawPointer());
+      }
+    }
+  };
+}
+
+/**
+ * Describe `F` with everything the placement depends on and nothing it
+ * does not: no symbol names, no type names and no pointer values.
+ * Alias analysis and speculation look at attributes (noalias, nonnull,
+ * dereferenceable, ...) of the function, its callees and its call sites,
+ * at constant globals and at metadata such as !tbaa, so those are
+ * described too. Attribute lists, constants and metadata nodes are
+ * numbered once per module, since two different type tags are not
+ * interchangeable. The terms close the description, so that term numbers
+ * in the cached placement correspond as well.
+ * `insts` receives the instructions in the order they are described, so
+ * instruction numbers in two functions with equal fingerprints correspond.
+ */
+void PRE::getFingerprint(Function &F, const std::vector<term_t> &terms,
+                         std::vector<unsigned> &fingerprint,
+                         std::vector<Instruction*> &insts) {
+  FingerprintBuilder builder(fingerprint, attributeNumbers, constantNumbers);
+  for (Argument &arg : F.args()) {
+    builder.locals[&arg] = builder.locals.size();
+  }
+  for (BasicBlock &bb : F) {
+    builder.locals[&bb] = builder.locals.size();
+    for (Instruction &inst : bb) {
+      builder.locals[&inst] = builder.locals.size();
+      insts.push_back(&inst);
+    }
+  }
+
+  builder.addType(F.getFunctionType());
+  builder.addAttributes(F.getAttributes().getRawPointer());
+  for (BasicBlock &bb : F) {
+    fingerprint.push_back(bb.size());
+    for (Instruction &inst : bb) {
+      fingerprint.push_back(inst.getOpcode());
+      fingerprint.push_back(inst.getRawSubclassOptionalData());
+      builder.addType(inst.getType());
+      if (CmpInst *cmpInst = dyn_cast<CmpInst>(&inst)) {
+        fingerprint.push_back(cmpInst->getPredicate());
+      } else if (LoadInst *loadInst = dyn_cast<LoadInst>(&inst)) {
+        fingerprint.push_back(loadInst->isVolatile());
+        fingerprint.push_back(loadInst->getAlignment());
+        fingerprint.push_back((unsigned)loadInst->getOrdering());
+      } else if (StoreInst *storeInst = dyn_cast<StoreInst>(&inst)) {
+        fingerprint.push_back(storeInst->isVolatile());
+      } else if (AllocaInst *allocaInst = dyn_cast<AllocaInst>(&inst)) {
+        builder.addType(allocaInst->getAllocatedType());
+      } else if (GetElementPtrInst *gepInst = dyn_cast<GetElementPtrInst>(&inst)) {
+        builder.addType(gepInst->getSourceElementType());
+      } else if (InvokeInst *invokeInst = dyn_cast<InvokeInst>(&inst)) {
+        builder.addAttributes(invokeInst->getAttributes().getRawPointer());
+      } else if (CallInst *callInst = dyn_cast<CallInst>(&inst)) {
+        // what the call may write decides what it kills.
+        fingerprint.push_back(callInst->doesNotAccessMemory());
+        fingerprint.push_back(callInst->onlyReadsMemory());
+        fingerprint.push_back(callInst->onlyAccessesArgMemory());
+        fingerprint.push_back(callInst->onlyAccessesInaccessibleMemory());
+        builder.addAttributes(callInst->getAttributes().getRawPointer());
+        Function *callee = callInst->getCalledFunction();
+        if (callee && !getModRefSummary(callee).unknown) {
+          const ModRefSummary &summary = getModRefSummary(callee);
+          fingerprint.push_back(summary.globals.size());
+          for (GlobalValue *global : summary.globals) {
+            builder.addValue(global);
+          }
+        } else {
+          fingerprint.push_back(~0U);
+        }
+      }
+      SmallVector<std::pair<unsigned, MDNode*>, 4> metadata;
+      inst.getAllMetadataOtherThanDebugLoc(metadata);
+      fingerprint.push_back(metadata.size());
+      for (auto &node : metadata) {
+        fingerprint.push_back(node.first);
+        auto number = metadataNumbers.insert(std::make_pair(node.second, metadataNumbers.size()));
+        fingerprint.push_back(number.first->second);
+      }
+      fingerprint.push_back(inst.getNumOperands());
+      for (Value *operand : inst.operands()) {
+        builder.addValue(operand);
+      }
+      if (PHINode *phi = dyn_cast<PHINode>(&inst)) {
+        for (BasicBlock *incoming : phi->blocks()) {
+          builder.addValue(incoming);
+        }
+      }
+    }
+  }
+
+  fingerprint.push_back(terms.size());
+  for (const term_t &term : terms) {
+    fingerprint.push_back(term_opcode(term));
+    fingerprint.push_back(term_predicate(term));
+    builder.addType(term_type(term));
+    if (term_source_type(term)) {
+      builder.addType(term_source_type(term));
+    } else {
+      fingerprint.push_back(~0U);
+    }
+    fingerprint.push_back(term.memory);
+    fingerprint.push_back(term_num_operands(term));
+    for (unsigned i = 0, e = term_num_operands(term); i != e; ++i) {
+      builder.addValue(term_operand(term, i));
+    }
+  }
+}
+
+bool PRE::runOnFunction(Function &F) {
+
+  bool Changed = false;
+
+  DEBUG(dbgs() << "#### PRE ####\n");
+
+  if (skipFunction(F)) {
+    return false;
+  }
+
+  // callees may have changed since the last function
+  summaries.clear();
+  getRanks(F);
+  leaders.clear();
 
   // for test
-  std::set<term_t> terms = getTerms(F);
-  for (auto term : terms) {
-    if(perform_OCP_RO_Transformation(F, term)) {
-      Changed = true;
+  std::vector<term_t> terms = getTerms(F);
+  LCMEngine engine = selectEngine(F, terms.size());
+  switch (engine) {
+  case PerTermEngine: NumEnginePerTerm++; break;
+  case BitVectorEngine: NumEngineBitVector++; break;
+  case MinCutEngine: NumEngineMinCut++; break;
+  case SparseEngine: NumEngineSparse++; break;
+  default: NumEngineSkip++; return false;
+  }
+
+  bool prepassChanged = false;
+  if (EnableDomPrepass || engine == SparseEngine) {
+    DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+    prepassChanged = eliminateFullyRedundant(F, DT);
+    Changed = Changed || prepassChanged;
+  }
+  if (engine == SparseEngine) {
+    return Changed;
+  }
+  // values are numbered only after the prepass, which erases instructions
+  // a value number may lead with.
+  getValueNumbers(F);
+  if (prepassChanged || EnableValueNumbering) {
+    terms = getTerms(F);
+  }
+
+  std::vector<BasicBlock*> splitBlocks;
+  if (SplitEdges && !terms.empty()) {
+    splitCriticalEdges(F, splitBlocks);
+  }
+
+  std::vector<Placement> placements(terms.size());
+
+  std::vector<unsigned> fingerprint;
+  std::vector<Instruction*> insts;
+  auto cached = placementCache.end();
+  // a profile, or alias analysis of the whole module, makes the placement
+  // depend on more than the function itself.
+  if (EnablePlacementReuse && !terms.empty() && !F.getEntryCount() &&
+      !getAnalysisIfAvailable<GlobalsAAWrapperPass>()) {
+    getFingerprint(F, terms, fingerprint, insts);
+    cached = placementCache.find(fingerprint);
+  }
+
+  if (cached != placementCache.end()) {
+    DEBUG(dbgs() << "#reusing placement for " << F.getName() << "\n");
+    for (unsigned i = 0, e = terms.size(); i != e; ++i) {
+      for (unsigned n : cached->second.OCP[i]) {
+        placements[i].OCP.insert(insts[n]);
+      }
+      for (unsigned n : cached->second.RO[i]) {
+        placements[i].RO.insert(insts[n]);
+      }
+    }
+    NumPlacementReused++;
+  } else {
+    startNode = getStartNode(F);
+    endNode = getEndNode(F);
+    AA = &getAnalysis<AAResultsWrapperPass>().getAAResults();
+    mem_modifies.clear();
+    for (const term_t &term : terms) {
+      if (term_opcode(term) == Instruction::Load) {
+        DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+        MSSA.reset(new MemorySSA(F, AA, &DT));
+        break;
+      }
+    }
+    // the min-cut engine speculates by itself.
+    anchors.clear();
+    if (EnableLoopSpeculation && engine != MinCutEngine) {
+      getAnchors(F, terms);
+    }
+    if (engine == BitVectorEngine) {
+      getPlacementsBitVector(F, terms, placements);
+    } else if (engine == MinCutEngine) {
+      getPlacementsMinCut(F, terms, placements);
+    } else {
+      for (unsigned i = 0, e = terms.size(); i != e; ++i) {
+        getPlacement(F, terms[i], placements[i]);
+      }
+    }
+    for (auto &anchor : anchors) {
+      for (unsigned i = 0, e = terms.size(); i != e; ++i) {
+        placements[i].RO.erase(anchor.first);
+      }
+    }
+    anchors.clear();
+    MSSA.reset();
+    mem_modifies.clear();
+
+    if (!fingerprint.empty()) {
+      DenseMap<Instruction*, unsigned> numbers;
+      for (unsigned n = 0, e = insts.size(); n != e; ++n) {
+        numbers[insts[n]] = n;
+      }
+      CachedPlacement &entry = placementCache[fingerprint];
+      entry.OCP.resize(terms.size());
+      entry.RO.resize(terms.size());
+      for (unsigned i = 0, e = terms.size(); i != e; ++i) {
+        for (auto inst : placements[i].OCP) {
+          entry.OCP[i].push_back(numbers[inst]);
+        }
+        for (auto inst : placements[i].RO) {
+          entry.RO[i].push_back(numbers[inst]);
+        }
+      }
+    }
+  }
+
+  if (EnablePressureLimit) {
+    limitRegisterPressure(F, terms, placements);
+  }
+
+  std::vector<AllocaInst*> temporaries;
+  bool performed = perform_OCP_RO_Transformation(F, terms, placements, temporaries);
+  if (removeSplitBlocks(splitBlocks)) {
+    Changed = true;
+  }
+  if (performed) {
+    Changed = true;
+
+    if (CoalesceSlots && !EmitSSA) {
+      coalesceTemporaries(F, temporaries);
+    }
+
+    // Nothing after -pre is guaranteed to promote the temporaries, so
+    // build SSA for them here: PromoteMemToReg places the PHIs on the
+    // iterated dominance frontiers of the OCPs and the redundant
+    // occurrences read registers instead of the stack.
+    if (EmitSSA) {
+      std::vector<AllocaInst*> promotable;
+      for (AllocaInst *temporary : temporaries) {
+        if (temporary && isAllocaPromotable(temporary)) {
+          promotable.push_back(temporary);
+        }
+      }
+      DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+      PromoteMemToReg(promotable, DT);
     }
   }
 
@@ -730,3 +3387,21 @@ bool PRE::runOnFunction(Function &F) {
   }
   return Changed;
 }
+
+bool PRE::doInitialization(Module &M) {
+  placementCache.clear();
+  metadataNumbers.clear();
+  attributeNumbers.clear();
+  constantNumbers.clear();
+  return false;
+}
+
+bool PRE::doFinalization(Module &M) {
+  placementCache.clear();
+  summaries.clear();
+  operandRanks.clear();
+  metadataNumbers.clear();
+  attributeNumbers.clear();
+  constantNumbers.clear();
+  return false;
+}
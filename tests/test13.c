@@ -0,0 +1,22 @@
+/**
+ * Comparisons, casts and selects as terms
+ * `i > lim` and `(long)lim` are partially redundant in the loop
+ */
+
+long test(int n) {
+  int i = 0;
+  int lim = 5;
+  long s = 0;
+  while (i < n) {
+    if (i > lim) {
+      s += (long)lim;
+    }
+    s += (i > lim) ? (long)lim : 1;
+    i++;
+  }
+  return s;
+}
+
+int main() {
+  return (int)test(12);
+}
@@ -0,0 +1,25 @@
+/**
+ * Loads as terms
+ * `g` and `*p` are loaded on one path and again after the join, the store
+ * through `q` kills `*p` but not `g`
+ */
+
+int g = 3;
+
+int test(int *p, int *q, int c) {
+  int s = 0;
+  if (c) {
+    s += g + *p;
+  }
+  s += g;
+  s += *p;
+  *q = 1;
+  s += *p;
+  return s;
+}
+
+int main() {
+  int a = 4;
+  int b = 0;
+  return test(&a, &b, 1) + test(&a, &a, 0);
+}
@@ -0,0 +1,31 @@
+/**
+ * Lazy strength reduction (-pre-strength-reduction)
+ * `i * 8` and `i * n` follow `i++` in their temporary instead of being
+ * recomputed, `j * n` is killed by `j += 2`
+ */
+
+int a[64];
+
+int test(int n) {
+  int i = 0;
+  int j = 0;
+  int s = 0;
+  while (i < 8) {
+    s += a[i * 8 + j];
+    s += i * n;
+    s += j * n;
+    i++;
+    if (s & 1) {
+      j += 2;
+    }
+  }
+  return s;
+}
+
+int main() {
+  int k;
+  for (k = 0; k < 64; k++) {
+    a[k] = k;
+  }
+  return test(3) + test(0);
+}
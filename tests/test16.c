@@ -0,0 +1,26 @@
+/**
+ * Stack-slot coalescing (-pre-coalesce-slots)
+ * The temporaries of `a + b`, `a * b` and `a - b` are never live at the
+ * same time, so without -pre-ssa they share one stack slot
+ */
+
+int test(int a, int b) {
+  int s = 0;
+  if (a) {
+    s = a + b;
+  }
+  s += a + b;
+  if (s != 5) {
+    s = a * b;
+  }
+  s += a * b;
+  if (s != 7) {
+    s = a - b;
+  }
+  s += a - b;
+  return s;
+}
+
+int main() {
+  return test(3, 4) + test(0, 2);
+}
@@ -0,0 +1,20 @@
+/**
+ * Dominator prepass with a load term and a term reading the same global
+ * The write to `h` kills the first `load g` but not `g + 1`, so the
+ * second `g + 1` is removed while its load leads the later `g`
+ */
+
+int g, h;
+
+int f() {
+  int s = 0;
+  s += g + 1;
+  h = 1;
+  s += (g + 1) + g;
+  return s;
+}
+
+int main() {
+  g = 2;
+  return f();
+}
@@ -0,0 +1,21 @@
+/**
+ * Lazy strength reduction of a product nested in another term
+ * (-pre-strength-reduction)
+ * `i * 8` follows `i++` in its temporary, but `i * 8 + j` does not and
+ * has to be computed again after it
+ */
+
+int test(int j) {
+  int i = 0;
+  int s = 0;
+  while (i < 6) {
+    s += i * 8 + j;
+    i++;
+    s = s * 3 + (i * 8 + j);
+  }
+  return s & 255;
+}
+
+int main() {
+  return test(5);
+}